@@ -0,0 +1,121 @@
+#include "treepoints.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Benchmark the sampled mode against the exact path.
+ * For each file, time ingest and processing at each
+ * sample rate, and check that the exact metrics fall
+ * within the sampled intervals. Exits with failure
+ * if any interval misses.
+ */
+
+double
+_now_ms ()
+{
+  struct timespec ts;
+  timespec_get (&ts, TIME_UTC);
+  return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+/*
+ * _check_ci:
+ * Print an estimate with its interval, and whether
+ * the exact value falls in it. Returns 1 if so.
+ */
+int
+_check_ci (const char *name, double est, conf_int_t ci, double exact)
+{
+  int ok = (ci.lo <= exact) && (exact <= ci.hi);
+  printf ("  %-12s %f [%f, %f] exact %f %s\n",
+      name, est, ci.lo, ci.hi, exact, ok ? "ok" : "MISS");
+  return ok;
+}
+
+main (int argc, char **argv)
+{
+  double default_rates[5] = { 0.5, 0.2, 0.1, 0.05, 0.01 };
+  double *rates = default_rates;
+  int num_rates = 5;
+  int misses = 0;
+
+  if (argc < 2)
+  {
+    fprintf (stderr, "Usage: %s FILE [RATE...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (argc > 2)
+  {
+    num_rates = argc - 2;
+    _safe_malloc (rates, sizeof (double) * num_rates);
+    for (int i = 0; i < num_rates; i++)
+      rates[i] = atof (argv[i + 2]);
+  }
+
+  printf ("=== Sampling benchmark: %s ===\n", argv[1]);
+
+  double start = _now_ms ();
+  tree_pointdata_t *exact = tree_pointdata_init (argv[1]);
+  double exact_ingest = _now_ms () - start;
+
+  start = _now_ms ();
+  double exact_trunk = tree_pointdata_get_trunkdiam (exact);
+  double exact_height = tree_pointdata_get_height (exact);
+  double exact_crown = tree_pointdata_get_maxbranchdiam (exact);
+  double exact_process = _now_ms () - start;
+
+  double exact_total = exact_ingest + exact_process;
+
+  printf ("exact: ingest %.2f ms, process %.2f ms, total %.2f ms\n",
+      exact_ingest, exact_process, exact_total);
+
+  for (int r = 0; r < num_rates; r++)
+  {
+    start = _now_ms ();
+    tree_pointdata_t *data = tree_pointdata_init_sampled (argv[1], rates[r]);
+    double ingest = _now_ms () - start;
+
+    start = _now_ms ();
+    double trunk = tree_pointdata_get_trunkdiam (data);
+    double height = tree_pointdata_get_height (data);
+    double crown = tree_pointdata_get_maxbranchdiam (data);
+    double process = _now_ms () - start;
+
+    double total = ingest + process;
+    double kept = tree_pointdata_get_kept_rate (data);
+
+    /*
+     * Both passes over the file still parse every line,
+     * so ingest bounds the end-to-end speedup, however
+     * much faster processing gets.
+     */
+    printf ("rate %g (kept %.3f): ingest %.2f ms, process %.2f ms, "
+        "total %.2f ms (%.1fx end to end, %.1fx processing)\n",
+        rates[r], kept, ingest, process, total,
+        total > 0 ? exact_total / total : 0,
+        process > 0 ? exact_process / process : 0);
+    if (kept > 2 * rates[r])
+      printf ("  note: each bucket keeps at least %d points, "
+          "so this is the same sample as any lower rate\n",
+          SAMPLE_MIN_PER_BUCKET);
+
+    misses += !_check_ci ("trunk", trunk,
+        tree_pointdata_get_trunkdiam_ci (data), exact_trunk);
+    misses += !_check_ci ("height", height,
+        tree_pointdata_get_height_ci (data), exact_height);
+    misses += !_check_ci ("max branch", crown,
+        tree_pointdata_get_maxbranchdiam_ci (data), exact_crown);
+
+    tree_pointdata_free (data);
+  }
+
+  printf ("%d interval(s) missed the exact value\n", misses);
+
+  tree_pointdata_free (exact);
+  if (rates != default_rates)
+    free (rates);
+
+  return (misses == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
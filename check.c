@@ -0,0 +1,297 @@
+#include "treepoints.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/*
+ * Check the geometry against brute force or known
+ * answers: the convex hull and its diameter on point
+ * sets that stress exact ties (points on an integer
+ * grid, points rounded to 0.01, and points all on one
+ * line), the minimum enclosing circle on small sets,
+ * and RANSAC trunk fits on noisy rings. Exits non-zero
+ * on any failure.
+ */
+
+#define CHECK_TRIALS 2000
+#define CHECK_MAX_POINTS 200
+/* Largest set for the quartic brute-force enclosing circle. */
+#define CHECK_MEC_POINTS 20
+/* Rings for RANSAC: radius, noise either way, and points per bucket. */
+#define CHECK_RING_RAD 0.15
+#define CHECK_RING_NOISE 0.02
+#define CHECK_RING_POINTS 100
+
+/*
+ * _check_hull:
+ * Check a hull of count points encloses them all
+ * and has the brute-force diameter. Returns 1 if so.
+ */
+int
+_check_hull (double *xs, double *ys, int count)
+{
+  int *hull = get_convhull_indices (xs, ys, count);
+  int hull_sz;
+  int ok = 1;
+
+  for (hull_sz = 0; hull[hull_sz] != -1; hull_sz++)
+    ;
+
+  /* Every point must lie on or left of every hull edge. */
+  for (int e = 0; e < hull_sz && hull_sz >= 3 && ok; e++)
+  {
+    int a = hull[e];
+    int b = hull[(e + 1) % hull_sz];
+
+    for (int i = 0; i < count; i++)
+    {
+      double turn = ((xs[b] - xs[a]) * (ys[i] - ys[a]))
+                    - ((ys[b] - ys[a]) * (xs[i] - xs[a]));
+      if (turn < -1e-9)
+      {
+        ok = 0;
+        break;
+      }
+    }
+  }
+
+  double best = 0;
+  for (int i = 0; i < count; i++)
+    for (int j = i + 1; j < count; j++)
+    {
+      double d = _square_dist (xs[i], xs[j], ys[i], ys[j]);
+      if (d > best)
+        best = d;
+    }
+
+  double diam = get_convhull_diam (xs, ys, hull, NULL, NULL);
+  if (fabs (diam - sqrt (best)) > 1e-9)
+    ok = 0;
+
+  free (hull);
+  return ok;
+}
+
+/*
+ * _rand_unit:
+ * Uniform random value in [0, 1].
+ */
+double
+_rand_unit ()
+{
+  return ((double) rand ()) / RAND_MAX;
+}
+
+/*
+ * _bucket_data:
+ * Make a cloud of num_buckets buckets, each holding
+ * count points from xs/ys, for calling the fits on.
+ */
+tree_pointdata_t *
+_bucket_data (double *xs, double *ys, int count, int num_buckets)
+{
+  tree_pointdata_t *data = calloc (1, sizeof (tree_pointdata_t));
+
+  data->z_num_buckets = num_buckets;
+  _safe_malloc (data->x_z_bucket, sizeof (double *) * num_buckets);
+  _safe_malloc (data->y_z_bucket, sizeof (double *) * num_buckets);
+  _safe_malloc (data->z_bucket_lengths, sizeof (unsigned int) * num_buckets);
+  _safe_malloc (data->z_bucket_stored, sizeof (unsigned int) * num_buckets);
+  for (int b = 0; b < num_buckets; b++)
+  {
+    data->x_z_bucket[b] = xs + (b * count);
+    data->y_z_bucket[b] = ys + (b * count);
+    data->z_bucket_lengths[b] = count;
+    data->z_bucket_stored[b] = count;
+  }
+
+  return data;
+}
+
+void
+_free_bucket_data (tree_pointdata_t *data)
+{
+  free (data->x_z_bucket);
+  free (data->y_z_bucket);
+  free (data->z_bucket_lengths);
+  free (data->z_bucket_stored);
+  free (data);
+}
+
+/*
+ * _encloses:
+ * Check a circle holds every point, allowing
+ * for rounding.
+ */
+int
+_encloses (double cx, double cy, double rad, double *xs, double *ys,
+           int count)
+{
+  for (int i = 0; i < count; i++)
+    if (sqrt (_square_dist (xs[i], cx, ys[i], cy)) > rad + 1e-9)
+      return 0;
+  return 1;
+}
+
+/*
+ * _check_mec:
+ * Check the enclosing circle of count points holds
+ * them all and is no larger than the smallest circle
+ * through two or three of them that does. Returns 1
+ * if so.
+ */
+int
+_check_mec (double *xs, double *ys, int count)
+{
+  tree_pointdata_t *data = _bucket_data (xs, ys, count, 1);
+  trunk_t trunk;
+  double best = INFINITY;
+
+  fit_trunk_mec (data, 0, &trunk);
+  _free_bucket_data (data);
+
+  for (int i = 0; i < count; i++)
+    for (int j = i + 1; j < count; j++)
+    {
+      double cx = (xs[i] + xs[j]) / 2;
+      double cy = (ys[i] + ys[j]) / 2;
+      double rad = sqrt (_square_dist (xs[i], cx, ys[i], cy));
+
+      if (rad < best && _encloses (cx, cy, rad, xs, ys, count))
+        best = rad;
+
+      for (int k = j + 1; k < count; k++)
+      {
+        double ax = xs[j] - xs[i], ay = ys[j] - ys[i];
+        double bx = xs[k] - xs[i], by = ys[k] - ys[i];
+        double d = 2 * ((ax * by) - (ay * bx));
+
+        if (d == 0)
+          continue;
+        cx = xs[i] + ((by * (ax * ax + ay * ay)) - (ay * (bx * bx + by * by))) / d;
+        cy = ys[i] + ((ax * (bx * bx + by * by)) - (bx * (ax * ax + ay * ay))) / d;
+        rad = sqrt (_square_dist (xs[i], cx, ys[i], cy));
+        if (rad < best && _encloses (cx, cy, rad, xs, ys, count))
+          best = rad;
+      }
+    }
+
+  if (count == 1)
+    best = 0;
+
+  return _encloses (trunk.circ.x, trunk.circ.y, trunk.circ.rad, xs, ys, count)
+         && trunk.circ.rad <= best + 1e-9;
+}
+
+/*
+ * _check_ransac:
+ * Fit RANSAC_NUM_BUCKETS noisy rings of radius
+ * CHECK_RING_RAD, and check the fitted radius is
+ * within the noise of it. Returns 1 if so.
+ */
+int
+_check_ransac ()
+{
+  int count = CHECK_RING_POINTS * RANSAC_NUM_BUCKETS;
+  double xs[CHECK_RING_POINTS * RANSAC_NUM_BUCKETS];
+  double ys[CHECK_RING_POINTS * RANSAC_NUM_BUCKETS];
+  tree_params_t params;
+  trunk_t trunk;
+
+  for (int i = 0; i < count; i++)
+  {
+    double ang = 2 * M_PI * _rand_unit ();
+    double rad = CHECK_RING_RAD + CHECK_RING_NOISE * (2 * _rand_unit () - 1);
+    xs[i] = 2 + rad * cos (ang);
+    ys[i] = -3 + rad * sin (ang);
+  }
+
+  tree_params_default (&params);
+  tree_pointdata_t *data = _bucket_data (xs, ys, CHECK_RING_POINTS,
+                                         RANSAC_NUM_BUCKETS);
+  bool ok = fit_trunk_ransac (data, RANSAC_NUM_BUCKETS - 1, &params, &trunk);
+  _free_bucket_data (data);
+
+  return ok && fabs (trunk.circ.rad - CHECK_RING_RAD) <= CHECK_RING_NOISE;
+}
+
+main (int argc, char **argv)
+{
+  double xs[CHECK_MAX_POINTS];
+  double ys[CHECK_MAX_POINTS];
+  int fails[3] = { 0, 0, 0 };
+  const char *kinds[3] = { "integer grid", "0.01 grid", "collinear" };
+
+  srand (1);
+
+  for (int t = 0; t < CHECK_TRIALS; t++)
+  {
+    int count = 2 + rand () % (CHECK_MAX_POINTS - 1);
+
+    /* Points in a disc, snapped to an integer grid. */
+    for (int i = 0; i < count; i++)
+    {
+      double ang = 2 * M_PI * rand () / RAND_MAX;
+      double rad = 10.0 * rand () / RAND_MAX;
+      xs[i] = round (rad * cos (ang));
+      ys[i] = round (rad * sin (ang));
+    }
+    fails[0] += !_check_hull (xs, ys, count);
+
+    /* The same in metres at 0.01, offset as real data is. */
+    for (int i = 0; i < count; i++)
+    {
+      xs[i] = xs[i] / 100 + 3.57;
+      ys[i] = ys[i] / 100 - 1.21;
+    }
+    fails[1] += !_check_hull (xs, ys, count);
+
+    /* Multiples of one step along a line, with repeats. */
+    int dx = rand () % 7 - 3;
+    int dy = rand () % 7 - 3;
+    for (int i = 0; i < count; i++)
+    {
+      int k = rand () % 20;
+      xs[i] = k * dx;
+      ys[i] = k * dy;
+    }
+    fails[2] += !_check_hull (xs, ys, count);
+  }
+
+  int total = 0;
+  for (int k = 0; k < 3; k++)
+  {
+    printf ("%-12s %d of %d failed\n", kinds[k], fails[k], CHECK_TRIALS);
+    total += fails[k];
+  }
+
+  int mec_fails = 0;
+  for (int t = 0; t < CHECK_TRIALS; t++)
+  {
+    int count = 1 + rand () % CHECK_MEC_POINTS;
+
+    /* Half on a grid, to give ties on the circle. */
+    for (int i = 0; i < count; i++)
+    {
+      xs[i] = 10 * _rand_unit ();
+      ys[i] = 10 * _rand_unit ();
+      if (t % 2 == 0)
+      {
+        xs[i] = round (xs[i]);
+        ys[i] = round (ys[i]);
+      }
+    }
+    mec_fails += !_check_mec (xs, ys, count);
+  }
+  printf ("%-12s %d of %d failed\n", "enclosing", mec_fails, CHECK_TRIALS);
+  total += mec_fails;
+
+  int ransac_fails = 0;
+  for (int t = 0; t < CHECK_TRIALS / 10; t++)
+    ransac_fails += !_check_ransac ();
+  printf ("%-12s %d of %d failed\n", "ransac ring", ransac_fails,
+      CHECK_TRIALS / 10);
+  total += ransac_fails;
+
+  return total == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,23 +3,238 @@
 #include <stdio.h>
 
 
-main ()
+/*
+ * _parse_list:
+ * Parse a list of values, either comma-separated
+ * or as LO:HI:STEP. Returns the number of values,
+ * or 0 if the list is malformed.
+ */
+unsigned int
+_parse_list (const char *str, double **vals)
+{
+  unsigned int num_vals = 0;
+  double lo, hi, step;
+  char *end;
+
+  *vals = NULL;
+
+  if (sscanf (str, "%lf:%lf:%lf", &lo, &hi, &step) == 3)
+  {
+    if (step <= 0 || hi < lo)
+      return 0;
+    /* Allow for rounding in the step reaching hi. */
+    num_vals = (unsigned int) ((hi - lo) / step + 1e-9) + 1;
+    _safe_malloc (*vals, sizeof (double) * num_vals);
+    for (int i = 0; i < num_vals; i++)
+      (*vals)[i] = lo + i * step;
+    return num_vals;
+  }
+
+  for (const char *c = str; *c != '\0'; c++)
+    if (*c == ',')
+      num_vals++;
+  _safe_malloc (*vals, sizeof (double) * ++num_vals);
+
+  for (int i = 0; i < num_vals; i++)
+  {
+    (*vals)[i] = strtod (str, &end);
+    if (end == str || (*end != ',' && *end != '\0'))
+    {
+      free (*vals);
+      *vals = NULL;
+      return 0;
+    }
+    str = end + 1;
+  }
+
+  return num_vals;
+}
+
+/*
+ * _print_sweep:
+ * Print a table of sweep results, one row per set.
+ * Where a RANSAC fit's inlier band stood in for the
+ * margin, the margin is shown as n/a.
+ */
+void
+_print_sweep (const sweep_result_t *results, unsigned int num_sets)
+{
+  const char *fit_names[3] = { "centroid", "mec", "ransac" };
+
+  printf ("%8s %8s %8s %8s %5s %12s %12s %12s\n", "fit", "diff", "maxdiff",
+      "margin", "top", "trunkdiam", "height", "maxbranch");
+  for (int i = 0; i < num_sets; i++)
+  {
+    const sweep_result_t *res = &results[i];
+    const char *fit_name = "?";
+
+    if (res->params.trunk_fit >= TRUNK_FIT_CENTROID
+        && res->params.trunk_fit <= TRUNK_FIT_RANSAC)
+      fit_name = fit_names[res->params.trunk_fit];
+
+    printf ("%8s %8g %8g ", fit_name, res->params.trunk_diff_thresh,
+        res->params.trunk_maxdiff_thresh);
+    if (res->valid && !res->margin_used)
+      printf ("%8s ", "n/a");
+    else
+      printf ("%8g ", res->params.trunk_circ_margin);
+
+    if (!res->valid)
+      printf ("%5s invalid settings\n", "-");
+    else
+      printf ("%5d %12f %12f %12f\n", res->trunk_top,
+          res->trunkdiam, res->treeheight, res->maxbranchdiam);
+  }
+}
+
+/*
+ * Usage: treepoints [-s RATE] [-r RANGE] [-d DIFF] [-m MAXDIFF]
+ *                   [-c MARGIN] [-f centroid|mec|ransac] [-j THREADS]
+ *                   [-D LIST] [-M LIST] [-C LIST] [FILE...]
+ * With -s, only a random sample of about RATE of
+ * each cloud is kept, and metrics are printed with
+ * their confidence intervals. -r sets the height of
+ * each z-bucket, -d/-m the trunk thresholds, -c the
+ * trunk circle margin, and -f how the trunk circle
+ * is fitted.
+ * -D/-M/-C sweep the trunk thresholds and margin over
+ * a LIST (A,B,... or LO:HI:STEP) instead. Each cloud
+ * is loaded once and a table printed with a row for
+ * every combination.
+ */
+main (int argc, char **argv)
 {
   /* Files are relative to build directory. */
-  char *files[4] = {
+  char *default_files[4] = {
      "..\\data\\Tree1.txt",
      "..\\data\\tree2b.txt",
      "..\\data\\tree3.txt",
      "..\\data\\tree4.txt"
   };
+  char **files = default_files;
+  int num_files = 4;
+  tree_params_t params;
+  int argi = 1;
+  /* Lists of values to sweep, for -D/-M/-C. */
+  double *sweep_vals[3] = { NULL, NULL, NULL };
+  unsigned int sweep_lens[3] = { 0, 0, 0 };
+  const char *sweep_opts = "DMC";
+
+  tree_params_default (&params);
+
+  for (; (argi + 1 < argc) && (argv[argi][0] == '-'); argi += 2)
+  {
+    double val = atof (argv[argi + 1]);
+
+    if (strcmp (argv[argi], "-f") == 0)
+    {
+      if (strcmp (argv[argi + 1], "centroid") == 0)
+        params.trunk_fit = TRUNK_FIT_CENTROID;
+      else if (strcmp (argv[argi + 1], "mec") == 0)
+        params.trunk_fit = TRUNK_FIT_MEC;
+      else if (strcmp (argv[argi + 1], "ransac") == 0)
+        params.trunk_fit = TRUNK_FIT_RANSAC;
+      else
+      {
+        fprintf (stderr, "Unknown trunk fit %s\n", argv[argi + 1]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (strcmp (argv[argi], "-j") == 0)
+      params.num_threads = (unsigned int) val;
+    else if (strcmp (argv[argi], "-s") == 0)
+      params.sample_rate = val;
+    else if (strcmp (argv[argi], "-r") == 0)
+      params.zbucket_range = val;
+    else if (strcmp (argv[argi], "-d") == 0)
+      params.trunk_diff_thresh = val;
+    else if (strcmp (argv[argi], "-m") == 0)
+      params.trunk_maxdiff_thresh = val;
+    else if (strcmp (argv[argi], "-c") == 0)
+      params.trunk_circ_margin = val;
+    else if (argv[argi][1] != '\0' && argv[argi][2] == '\0'
+             && strchr (sweep_opts, argv[argi][1]) != NULL)
+    {
+      int k = strchr (sweep_opts, argv[argi][1]) - sweep_opts;
+
+      free (sweep_vals[k]);
+      sweep_lens[k] = _parse_list (argv[argi + 1], &sweep_vals[k]);
+      if (sweep_lens[k] == 0)
+      {
+        fprintf (stderr, "Bad list %s for %s\n", argv[argi + 1], argv[argi]);
+        return EXIT_FAILURE;
+      }
+    }
+    else
+    {
+      fprintf (stderr, "Unknown option %s\n", argv[argi]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argi < argc)
+  {
+    files = argv + argi;
+    num_files = argc - argi;
+  }
 
   printf ("=== Tree Point Cloud Project ===\n");
 
-  for (int i = 0; i < 4; i++)
+  if (sweep_lens[0] + sweep_lens[1] + sweep_lens[2] > 0)
+  {
+    /* Values not swept stay as set by -d/-m/-c. */
+    double fixed[3] = { params.trunk_diff_thresh,
+                        params.trunk_maxdiff_thresh,
+                        params.trunk_circ_margin };
+
+    for (int k = 0; k < 3; k++)
+      if (sweep_lens[k] == 0)
+      {
+        sweep_lens[k] = 1;
+        _safe_malloc (sweep_vals[k], sizeof (double));
+        sweep_vals[k][0] = fixed[k];
+      }
+
+    unsigned int num_sets = sweep_lens[0] * sweep_lens[1] * sweep_lens[2];
+    tree_params_t *sets;
+    int set = 0;
+
+    _safe_malloc (sets, sizeof (tree_params_t) * num_sets);
+    for (int d = 0; d < sweep_lens[0]; d++)
+      for (int m = 0; m < sweep_lens[1]; m++)
+        for (int c = 0; c < sweep_lens[2]; c++, set++)
+        {
+          sets[set] = params;
+          sets[set].trunk_diff_thresh = sweep_vals[0][d];
+          sets[set].trunk_maxdiff_thresh = sweep_vals[1][m];
+          sets[set].trunk_circ_margin = sweep_vals[2][c];
+        }
+
+    for (int i = 0; i < num_files; i++)
+    {
+      printf ("\nSweep of %u settings for file %s\n", num_sets, files[i]);
+
+      tree_pointdata_t *data = tree_pointdata_init_params (files[i], &params);
+      sweep_result_t *results = tree_pointdata_sweep (data, sets, num_sets);
+
+      _print_sweep (results, num_sets);
+      printf ("===========================\n");
+
+      free (results);
+      tree_pointdata_free (data);
+    }
+
+    free (sets);
+    for (int k = 0; k < 3; k++)
+      free (sweep_vals[k]);
+    return EXIT_SUCCESS;
+  }
+
+  for (int i = 0; i < num_files; i++)
   {
     printf ("\nData for file %s\n", files[i]);
 
-    tree_pointdata_t *data = tree_pointdata_init (files[i]);
+    tree_pointdata_t *data = tree_pointdata_init_params (files[i], &params);
 
     printf ("Trunk diameter: %f\n",
         tree_pointdata_get_trunkdiam (data));
@@ -27,6 +242,30 @@ main ()
         tree_pointdata_get_height (data));
     printf ("Max branch diameter: %f\n",
         tree_pointdata_get_maxbranchdiam (data));
+
+    if (params.sample_rate < 1)
+    {
+      conf_int_t trunk_ci = tree_pointdata_get_trunkdiam_ci (data);
+      conf_int_t height_ci = tree_pointdata_get_height_ci (data);
+      conf_int_t crown_ci = tree_pointdata_get_maxbranchdiam_ci (data);
+
+      printf ("Sampled at rate %g (kept %.3f), approximate %g%% intervals:\n",
+          params.sample_rate, tree_pointdata_get_kept_rate (data),
+          100 * (1 - APPROX_CONF_ALPHA));
+      printf ("  Trunk diameter: [%f, %f]\n", trunk_ci.lo, trunk_ci.hi);
+      printf ("  Tree height: [%f, %f]\n", height_ci.lo, height_ci.hi);
+      printf ("  Max branch diameter: [%f, %f]\n", crown_ci.lo, crown_ci.hi);
+    }
+
+    const double *bucket_diams, *cum_diams;
+    double base_z;
+    unsigned int num_crown = tree_pointdata_get_crown_profile (
+        data, &bucket_diams, &cum_diams, &base_z);
+
+    printf ("Crown profile (bucket base z: bucket / cumulative diameter):\n");
+    for (int j = num_crown - 1; j >= 0; j--)
+      printf ("  %f: %f / %f\n", base_z + (j * params.zbucket_range),
+          bucket_diams[j], cum_diams[j]);
     printf ("===========================\n");
 
     tree_pointdata_free (data);
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
 
 
 #define _MAX_LINELEN 1024
@@ -50,12 +52,188 @@ _readline (char **out, size_t *len, FILE *fp)
 
 
 /*
- * tree_pointdata_init:
+ * _readline_buf:
+ * Read a line into a caller's buffer of
+ * _MAX_LINELEN chars, without allocating.
+ * Returns -1 at end of file, or if the line
+ * is too long, as _readline does.
+ */
+int
+_readline_buf (char *buf, FILE *fp)
+{
+  if (fgets (buf, _MAX_LINELEN, fp) == NULL)
+    return -1;
+
+  char *end = strchr (buf, '\n');
+  if (end != NULL)
+    *end = '\0';
+  else if (!feof (fp))
+    return -1;
+
+  return 0;
+}
+
+/*
+ * _rand_next:
+ * Step a xorshift64 generator, returning its
+ * next value. The state must never be zero.
+ */
+unsigned long long
+_rand_next (unsigned long long *state)
+{
+  unsigned long long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/*
+ * _parse_z:
+ * Read only the z-coordinate of an "x, y, z" line,
+ * which is much cheaper than scanning all three.
+ */
+double
+_parse_z (const char *line)
+{
+  const char *last_comma = strrchr (line, ',');
+  return strtod ((last_comma != NULL) ? (last_comma + 1) : line, NULL);
+}
+
+/*
+ * _get_z_bucket:
+ * Find the z-bucket a z-coordinate falls in.
+ */
+unsigned int
+_get_z_bucket (tree_pointdata_t *data, double z)
+{
+  unsigned int bucket = (unsigned int) ((z - data->min_z)
+                                        / data->params.zbucket_range);
+  /* The last bucket also takes the remainder up to max_z. */
+  if (bucket >= data->z_num_buckets)
+    bucket = data->z_num_buckets - 1;
+  return bucket;
+}
+
+/*
+ * _alloc_buckets:
+ * Allocate empty z-buckets of a given initial
+ * size, once min_z and max_z are known.
+ */
+void
+_alloc_buckets (tree_pointdata_t *data, unsigned int bucket_sz)
+{
+  size_t num_buckets = (size_t) ((data->max_z - data->min_z)
+                                 / data->params.zbucket_range);
+
+  /* A range above the cloud's height still needs one bucket. */
+  if (num_buckets == 0)
+    num_buckets = 1;
+
+  _safe_malloc (data->x_z_bucket, sizeof(double *) * num_buckets);
+  _safe_malloc (data->y_z_bucket, sizeof(double *) * num_buckets);
+  _safe_malloc (data->z_z_bucket, sizeof(double *) * num_buckets);
+  _safe_malloc (data->z_bucket_lengths, sizeof(unsigned int) * num_buckets);
+  _safe_malloc (data->z_bucket_stored, sizeof(unsigned int) * num_buckets);
+
+  for (int j = 0; j < num_buckets; j++)
+  {
+    _safe_malloc (data->x_z_bucket[j], sizeof(double) * bucket_sz);
+    _safe_malloc (data->y_z_bucket[j], sizeof(double) * bucket_sz);
+    _safe_malloc (data->z_z_bucket[j], sizeof(double) * bucket_sz);
+    data->z_bucket_lengths[j] = 0;
+    data->z_bucket_stored[j] = 0;
+  }
+
+  data->z_num_buckets = num_buckets;
+  data->processed = 0;
+
+  data->crown_bucket_diams = NULL;
+  data->crown_cum_diams = NULL;
+  data->crown_num_buckets = 0;
+}
+
+/*
+ * _build_pyramid:
+ * Build the pyramid of bucket counts, once
+ * all buckets are filled.
+ */
+void
+_build_pyramid (tree_pointdata_t *data)
+{
+  zbucket_pyramid_t *pyr = &data->pyramid;
+  unsigned int num_levels = 1;
+
+  for (unsigned int len = data->z_num_buckets; len > 1; len = (len + 1) / 2)
+    num_levels++;
+
+  pyr->num_levels = num_levels;
+  _safe_malloc (pyr->mins, sizeof (unsigned int *) * num_levels);
+  _safe_malloc (pyr->maxs, sizeof (unsigned int *) * num_levels);
+
+  /*
+   * Level 0 is the bucket counts themselves. Each
+   * higher level merges pairs of nodes from the one
+   * below, with an odd node at the top carried up
+   * alone, so the whole pyramid is built in time
+   * linear in the number of buckets.
+   */
+  unsigned int len = data->z_num_buckets;
+  _safe_malloc (pyr->mins[0], sizeof (unsigned int) * len);
+  _safe_malloc (pyr->maxs[0], sizeof (unsigned int) * len);
+  for (int j = 0; j < len; j++)
+  {
+    pyr->mins[0][j] = data->z_bucket_lengths[j];
+    pyr->maxs[0][j] = data->z_bucket_lengths[j];
+  }
+
+  for (int k = 1; k < num_levels; k++)
+  {
+    unsigned int prev_len = len;
+    len = (len + 1) / 2;
+    _safe_malloc (pyr->mins[k], sizeof (unsigned int) * len);
+    _safe_malloc (pyr->maxs[k], sizeof (unsigned int) * len);
+
+    for (int j = 0; j < len; j++)
+    {
+      int lo = 2 * j;
+      int hi = (2 * j + 1 < prev_len) ? (2 * j + 1) : lo;
+
+      pyr->mins[k][j] = (pyr->mins[k-1][lo] < pyr->mins[k-1][hi])
+                        ? pyr->mins[k-1][lo] : pyr->mins[k-1][hi];
+      pyr->maxs[k][j] = (pyr->maxs[k-1][lo] > pyr->maxs[k-1][hi])
+                        ? pyr->maxs[k-1][lo] : pyr->maxs[k-1][hi];
+    }
+  }
+}
+
+/*
+ * tree_params_default:
+ * Fill in the default settings.
+ */
+void
+tree_params_default (tree_params_t *params)
+{
+  params->zbucket_range = ZBUCKET_RANGE;
+  params->zbucket_size = ZBUCKET_SIZE;
+  params->trunk_diff_thresh = TRUNK_BUCKET_DIFF_THRESH;
+  params->trunk_maxdiff_thresh = TRUNK_BUCKET_MAXDIFF_THRESH;
+  params->trunk_circ_margin = TRUNK_CIRC_MARGIN;
+  params->sample_rate = 1;
+  params->trunk_fit = TRUNK_FIT_DEFAULT;
+  params->ransac_buckets = RANSAC_NUM_BUCKETS;
+  params->ransac_inlier_tol = RANSAC_INLIER_TOL;
+  params->num_threads = NUM_THREADS;
+}
+
+/*
+ * _init_exact:
  * Initialize a new tree_pointdata_t element
- * based on a file path to read from.
+ * holding every point of a file.
  */
 tree_pointdata_t *
-tree_pointdata_init (const char *path)
+_init_exact (const char *path, const tree_params_t *params)
 {
   char *line;
   size_t len = 0;
@@ -67,13 +245,14 @@ tree_pointdata_init (const char *path)
   /* Allocate data memory. */
 
   _safe_malloc (data, sizeof(tree_pointdata_t));
+  data->params = *params;
   _safe_malloc (data->xs, sizeof(tree_pointdata_t)*curr_coordlen);
   _safe_malloc (data->ys, sizeof(tree_pointdata_t)*curr_coordlen);
   _safe_malloc (data->zs, sizeof(tree_pointdata_t)*curr_coordlen);
 
   FILE *inp_file = fopen (path, "r");
   if (inp_file == NULL)
-    _EXIT_FAIL ("Error in tree_pointdata_init on reading file")
+    _EXIT_FAIL ("Error in _init_exact on reading file")
 
   /* Read file line-by-line or coordinates. */
   while (_readline (&line, &len, inp_file) != -1)
@@ -111,29 +290,16 @@ tree_pointdata_init (const char *path)
   data->min_z = min_z;
 
   if (fclose (inp_file) == EOF)
-    _EXIT_FAIL ("Error in tree_pointdata_init on closing file")
+    _EXIT_FAIL ("Error in _init_exact on closing file")
 
   /* Compute buckets for x and y. */
 
-  size_t num_buckets = (size_t) ((max_z - min_z) / ZBUCKET_RANGE);
-
-  _safe_malloc (data->x_z_bucket, sizeof(double *) * num_buckets);
-  _safe_malloc (data->y_z_bucket, sizeof(double *) * num_buckets);
-  _safe_malloc (data->z_z_bucket, sizeof(double *) * num_buckets);
-  _safe_malloc (data->z_bucket_lengths, sizeof(unsigned int) * num_buckets);
+  _alloc_buckets (data, params->zbucket_size);
 
   unsigned int *curr_bucket_lengths;
-  _safe_malloc (curr_bucket_lengths, sizeof(unsigned int) * num_buckets);
-  for (int j = 0; j < num_buckets; j++)
-    curr_bucket_lengths[j] = ZBUCKET_SIZE;
-
-  for (int j = 0; j < (int) ((max_z - min_z) / ZBUCKET_RANGE); j++)
-  {
-    _safe_malloc (data->x_z_bucket[j], sizeof(double) * ZBUCKET_SIZE);
-    _safe_malloc (data->y_z_bucket[j], sizeof(double) * ZBUCKET_SIZE);
-    _safe_malloc (data->z_z_bucket[j], sizeof(double) * ZBUCKET_SIZE);
-    data->z_bucket_lengths[j] = 0;
-  }
+  _safe_malloc (curr_bucket_lengths, sizeof(unsigned int) * data->z_num_buckets);
+  for (int j = 0; j < data->z_num_buckets; j++)
+    curr_bucket_lengths[j] = params->zbucket_size;
 
   for (int j = 0; j < coordlen; j++)
   {
@@ -141,15 +307,12 @@ tree_pointdata_init (const char *path)
     double y = data->ys[j];
     double z = data->zs[j];
 
-    unsigned int bucket = (unsigned int) ((z - min_z) / ZBUCKET_RANGE);
-    /* Special case if z == max_z */
-    if (bucket == num_buckets)
-      bucket--;
+    unsigned int bucket = _get_z_bucket (data, z);
     unsigned int in_bucket_pos = data->z_bucket_lengths[bucket];
 
     if (in_bucket_pos >= curr_bucket_lengths[bucket])
     {
-      curr_bucket_lengths[bucket] += ZBUCKET_SIZE;
+      curr_bucket_lengths[bucket] += params->zbucket_size;
       _safe_realloc (data->x_z_bucket[bucket],
           sizeof(double) * curr_bucket_lengths[bucket]);
       _safe_realloc (data->y_z_bucket[bucket],
@@ -163,251 +326,1448 @@ tree_pointdata_init (const char *path)
     data->z_z_bucket[bucket][in_bucket_pos] = z;
 
     data->z_bucket_lengths[bucket]++;
+    data->z_bucket_stored[bucket]++;
   }
 
-  data->z_num_buckets = num_buckets;
-  data->processed = 0;
+  free (curr_bucket_lengths);
+
+  _build_pyramid (data);
+
+  return data;
+}
+
+/*
+ * _cmp_uint:
+ * Compare two unsigned ints, for sorting ascending.
+ */
+int
+_cmp_uint (const void *v1, const void *v2)
+{
+  unsigned int u1 = *((const unsigned int *) v1);
+  unsigned int u2 = *((const unsigned int *) v2);
+
+  return (u1 > u2) - (u1 < u2);
+}
+
+/*
+ * _sample_bucket_size:
+ * Find the reservoir size per bucket that keeps
+ * about sample_rate of the cloud, given a random
+ * sample of its z-values. A bucket with fewer points
+ * than this is kept whole, so the larger size makes
+ * up for the share it leaves unused.
+ */
+unsigned int
+_sample_bucket_size (tree_pointdata_t *data, const double *zs,
+                     unsigned int num_zs, double sample_rate)
+{
+  /*
+   * Water-filling on the estimated bucket counts: with
+   * counts sorted ascending, each bucket smaller than an
+   * even split of what is left is kept whole, and the
+   * rest split what remains evenly.
+   */
+  unsigned int num_buckets = data->z_num_buckets;
+  unsigned int *hist;
+  double size;
+
+  _safe_malloc (hist, sizeof (unsigned int) * num_buckets);
+  for (int j = 0; j < num_buckets; j++)
+    hist[j] = 0;
+  for (int i = 0; i < num_zs; i++)
+    hist[_get_z_bucket (data, zs[i])]++;
+
+  qsort (hist, num_buckets, sizeof (unsigned int), _cmp_uint);
+
+  double left = sample_rate * num_zs;
+  size = hist[num_buckets - 1];
+  for (int j = 0; j < num_buckets; j++)
+  {
+    double even_split = left / (num_buckets - j);
+    if (hist[j] >= even_split)
+    {
+      size = even_split;
+      break;
+    }
+    left -= hist[j];
+  }
+  free (hist);
+
+  /* Scale from the estimate sample up to the cloud. */
+  if (num_zs > 0)
+    size *= ((double) data->num_coords) / num_zs;
+
+  unsigned int bucket_sz = (unsigned int) ceil (size);
+  if (bucket_sz < SAMPLE_MIN_PER_BUCKET)
+    bucket_sz = SAMPLE_MIN_PER_BUCKET;
+  return bucket_sz;
+}
+
+/*
+ * _init_sampled:
+ * Initialize a new tree_pointdata_t element from
+ * a file path, keeping only a random sample of
+ * roughly params->sample_rate of its points.
+ * Bucket counts are still exact.
+ */
+tree_pointdata_t *
+_init_sampled (const char *path, const tree_params_t *params)
+{
+  char line[_MAX_LINELEN];
+  tree_pointdata_t *data;
+  int coordlen = 0;
+  double max_z, min_z;
+  double *est_zs;
+  unsigned int num_est_zs = 0;
+
+  /*
+   * We never hold the full cloud. A first pass over
+   * the file finds the z range, so buckets can be laid
+   * out, and keeps a small reservoir of z-values to
+   * estimate how full each bucket is; a second pass keeps
+   * a reservoir sample per bucket alongside its exact
+   * count. Every bucket's reservoir is the same size, so
+   * sparse buckets such as the trunk are kept whole while
+   * the dense crown and ground are thinned, and the size
+   * is set so that the share sparse buckets leave unused
+   * goes to the dense ones.
+   */
+  _safe_malloc (data, sizeof(tree_pointdata_t));
+  data->params = *params;
+  data->xs = NULL;
+  data->ys = NULL;
+  data->zs = NULL;
+
+  FILE *inp_file = fopen (path, "r");
+  if (inp_file == NULL)
+    _EXIT_FAIL ("Error in _init_sampled on reading file")
+
+  unsigned long long rand_state = RAND_SEED;
+
+  _safe_malloc (est_zs, sizeof (double) * SAMPLE_Z_ESTIMATE);
+
+  while (_readline_buf (line, inp_file) != -1)
+  {
+    double z = _parse_z (line);
+
+    if ((coordlen == 0) || (max_z < z))
+      max_z = z;
+    if ((coordlen == 0) || (min_z > z))
+      min_z = z;
+
+    if (num_est_zs < SAMPLE_Z_ESTIMATE)
+      est_zs[num_est_zs++] = z;
+    else
+    {
+      unsigned int pos = _rand_next (&rand_state) % (coordlen + 1);
+      if (pos < SAMPLE_Z_ESTIMATE)
+        est_zs[pos] = z;
+    }
+
+    coordlen++;
+  }
+
+  data->num_coords = coordlen;
+  data->max_z = max_z;
+  data->min_z = min_z;
+
+  _alloc_buckets (data, SAMPLE_MIN_PER_BUCKET);
+
+  unsigned int bucket_sz = _sample_bucket_size (data, est_zs, num_est_zs,
+                                                params->sample_rate);
+  free (est_zs);
+
+  /* Bucket storage grows as needed, up to bucket_sz. */
+  unsigned int *bucket_caps;
+  _safe_malloc (bucket_caps, sizeof (unsigned int) * data->z_num_buckets);
+  for (int j = 0; j < data->z_num_buckets; j++)
+    bucket_caps[j] = SAMPLE_MIN_PER_BUCKET;
+
+  rewind (inp_file);
+
+  while (_readline_buf (line, inp_file) != -1)
+  {
+    double x, y, z = _parse_z (line);
+
+    unsigned int bucket = _get_z_bucket (data, z);
+    unsigned int seen = data->z_bucket_lengths[bucket]++;
+    unsigned int in_bucket_pos = seen;
+
+    /*
+     * Reservoir sampling: once a bucket is full, the
+     * n-th point replaces a random slot with
+     * probability size/n. Only points we keep
+     * are fully parsed.
+     */
+    if (seen >= bucket_sz)
+    {
+      in_bucket_pos = _rand_next (&rand_state) % (seen + 1);
+      if (in_bucket_pos >= bucket_sz)
+        continue;
+    }
+    else
+    {
+      if (seen >= bucket_caps[bucket])
+      {
+        bucket_caps[bucket] = (2 * bucket_caps[bucket] < bucket_sz)
+                              ? (2 * bucket_caps[bucket]) : bucket_sz;
+        _safe_realloc (data->x_z_bucket[bucket],
+            sizeof(double) * bucket_caps[bucket]);
+        _safe_realloc (data->y_z_bucket[bucket],
+            sizeof(double) * bucket_caps[bucket]);
+        _safe_realloc (data->z_z_bucket[bucket],
+            sizeof(double) * bucket_caps[bucket]);
+      }
+      data->z_bucket_stored[bucket]++;
+    }
+
+    sscanf (line, "%lf, %lf, %lf", &x, &y, &z);
+
+    data->x_z_bucket[bucket][in_bucket_pos] = x;
+    data->y_z_bucket[bucket][in_bucket_pos] = y;
+    data->z_z_bucket[bucket][in_bucket_pos] = z;
+  }
+
+  free (bucket_caps);
+
+  if (fclose (inp_file) == EOF)
+    _EXIT_FAIL ("Error in _init_sampled on closing file")
+
+  _build_pyramid (data);
 
   return data;
 }
 
 /*
- * cos_from_xaxis:
- * Find the cosine between two vectors,
- * [0,0]->P and O->[1, 0].
+ * tree_params_valid:
+ * Check every setting is in range. NaNs fail.
+ */
+bool
+tree_params_valid (const tree_params_t *params)
+{
+  return (params->zbucket_range > 0) && (params->zbucket_size > 0)
+         && (params->trunk_diff_thresh > 0)
+         && (params->trunk_maxdiff_thresh >= 0)
+         && (params->trunk_circ_margin >= 0)
+         && (params->sample_rate > 0)
+         && (params->trunk_fit >= TRUNK_FIT_CENTROID)
+         && (params->trunk_fit <= TRUNK_FIT_RANSAC)
+         && (params->ransac_buckets > 0)
+         && (params->ransac_inlier_tol > 0)
+         && (params->num_threads > 0);
+}
+
+/*
+ * tree_pointdata_init_params:
+ * Initialize a new tree_pointdata_t element
+ * based on a file path to read from, with
+ * the given settings.
+ */
+tree_pointdata_t *
+tree_pointdata_init_params (const char *path, const tree_params_t *params)
+{
+  if (!tree_params_valid (params))
+  {
+    errno = EINVAL;
+    _EXIT_FAIL ("Error in tree_pointdata_init_params on settings")
+  }
+
+  if (params->sample_rate >= 1)
+    return _init_exact (path, params);
+  else
+    return _init_sampled (path, params);
+}
+
+/*
+ * tree_pointdata_init:
+ * Initialize a new tree_pointdata_t element
+ * based on a file path to read from.
+ */
+tree_pointdata_t *
+tree_pointdata_init (const char *path)
+{
+  tree_params_t params;
+
+  tree_params_default (&params);
+  return tree_pointdata_init_params (path, &params);
+}
+
+/*
+ * tree_pointdata_init_sampled:
+ * Initialize a new tree_pointdata_t element from
+ * a file path, keeping only a random sample of
+ * roughly sample_rate of its points. A rate of 1
+ * or more reads the whole cloud.
+ */
+tree_pointdata_t *
+tree_pointdata_init_sampled (const char *path, double sample_rate)
+{
+  tree_params_t params;
+
+  tree_params_default (&params);
+  params.sample_rate = sample_rate;
+  return tree_pointdata_init_params (path, &params);
+}
+
+/*
+ * _max_upper_bound:
+ * Robson and Whitlock's one-sided upper confidence
+ * bound, at level 1 - alpha, on the largest value
+ * in a population, given the two largest values
+ * in a random sample of it.
  */
 double
-cos_from_xaxis (double px, double py)
+_max_upper_bound (double first, double second, double alpha)
+{
+  return first + ((1 - alpha) / alpha) * (first - second);
+}
+
+/*
+ * _cross:
+ * Z-coordinate of the cross product of
+ * (x1, y1)->(x2, y2) and (x1, y1)->(x3, y3).
+ * Positive if the three points make a left turn.
+ */
+#define _cross(x1, y1, x2, y2, x3, y3) \
+  ((((x2)-(x1)) * ((y3)-(y1))) - (((y2)-(y1)) * ((x3)-(x1))))
+
+/*
+ * _turn:
+ * Sign of _cross, taking turns too small to tell
+ * from rounding, relative to the size of the two
+ * products, as collinear (0). Sorting and building
+ * the hull must agree on which points are collinear,
+ * or points rounded differently in each get dropped.
+ */
+int
+_turn (double x1, double y1, double x2, double y2, double x3, double y3)
+{
+  double left = (x2 - x1) * (y3 - y1);
+  double right = (y2 - y1) * (x3 - x1);
+  double tol = HULL_COLLINEAR_TOL * (fabs (left) + fabs (right));
+
+  if (left - right > tol)
+    return 1;
+  else if (right - left > tol)
+    return -1;
+  return 0;
+}
+
+/*
+ * cmp_angle_indices:
+ * Compare two points, reformed as cmp_val_t
+ * values, by their angles from the x-axis
+ * about the origin. Smaller angles come first,
+ * and ties are broken by distance from the
+ * origin, nearest first. All points must lie on
+ * or above the x-axis, and to its right if on it.
+ */
+int
+cmp_angle_indices (const void *v1, const void *v2)
 {
-  return px / sqrt ((px * px) + (py * py));
+  /*
+   * Compare by the sign of the cross product rather
+   * than by a computed angle or cosine: points on the
+   * same ray then tie, whereas their cosines can differ
+   * in the last bit and put the farther point first.
+   */
+  cmp_val_t *ind1 = (cmp_val_t *) v1;
+  cmp_val_t *ind2 = (cmp_val_t *) v2;
+
+  int turn = _turn (0, 0, ind1->x, ind1->y, ind2->x, ind2->y);
+
+  if (turn > 0)
+    return -1;
+  else if (turn < 0)
+    return 1;
+
+  double sqdist1 = _square_dist (ind1->x, 0, ind1->y, 0);
+  double sqdist2 = _square_dist (ind2->x, 0, ind2->y, 0);
+
+  if (sqdist1 < sqdist2)
+    return -1;
+  else if (sqdist1 == sqdist2)
+    return 0;
+  else
+    return 1;
+}
+
+/*
+ * get_convhull_indices:
+ * Get all indices of points in the convex hull
+ * of a set of points, as a -1-terminated list
+ * in anticlockwise order.
+ */
+int *
+get_convhull_indices (double *xs, double *ys, int count)
+{
+  /*
+   * Our algorithm is O(nlogn) complexity. We
+   * sort the points by their angle to the lowest
+   * point Y-axis-wise, then accumulate points into
+   * the hull in this order, removing previous points
+   * if they make a concave angle to the current one.
+   */
+  int *conv_indices;
+  _safe_malloc (conv_indices, sizeof (int) * (count + 1));
+
+  if (count <= 0)
+  {
+    conv_indices[0] = -1;
+    return conv_indices;
+  }
+
+  int lowest = 0;
+
+  for (int i = 1; i < count; i++)
+  {
+    if ((ys[i] < ys[lowest])
+        || ((ys[i] == ys[lowest]) && (xs[i] < xs[lowest])))
+      lowest = i;
+  }
+
+  /*
+   * Quicksort all other points by angle to the
+   * lowest point. We need to produce comparable
+   * values rather than two arrays, and need to
+   * zero-adjust them so the lowest point is at the
+   * origin. (This will have no impact on later
+   * computations, as we are merely producing a
+   * list of indices.)
+   */
+  cmp_val_t *sort_vals;
+  int sort_sz = 0;
+  _safe_malloc (sort_vals, sizeof (cmp_val_t) * count);
+
+  for (int i = 0; i < count; i++)
+  {
+    if (i == lowest)
+      continue;
+    sort_vals[sort_sz].ind = i;
+    sort_vals[sort_sz].x = xs[i] - xs[lowest];
+    sort_vals[sort_sz].y = ys[i] - ys[lowest];
+    sort_sz++;
+  }
+
+  qsort ((void *) sort_vals, sort_sz, sizeof (cmp_val_t), cmp_angle_indices);
+
+  /*
+   * Now iterate through all points, keeping the hull
+   * so far as a stack. Each new point should make a
+   * 'left turn' with the top two points on the stack;
+   * while it does not, the top point is not in the
+   * convex hull and is popped. Collinear points are
+   * dropped too, so only corners are kept.
+   */
+  int convindices_top = 1;
+  conv_indices[0] = lowest;
+
+  for (int i = 0; i < sort_sz; i++)
+  {
+    int curr = sort_vals[i].ind;
+
+    while (convindices_top >= 2)
+    {
+      int prev1 = conv_indices[convindices_top - 1];
+      int prev2 = conv_indices[convindices_top - 2];
+      if (_turn (xs[prev2], ys[prev2], xs[prev1], ys[prev1],
+                 xs[curr], ys[curr]) > 0)
+        break;
+      convindices_top--;
+    }
+    /* Drop exact duplicates of the lowest point. */
+    if (convindices_top == 1
+        && xs[curr] == xs[lowest] && ys[curr] == ys[lowest])
+      continue;
+
+    conv_indices[convindices_top] = curr;
+    convindices_top++;
+  }
+  conv_indices[convindices_top] = -1;
+
+  free (sort_vals);
+
+  return conv_indices;
+}
+
+/*
+ * get_convhull_diam:
+ * Get the largest distance between two points
+ * on a convex hull, given as a -1-terminated
+ * list of anticlockwise indices into xs/ys.
+ * If far1/far2 are not NULL, they are set to
+ * the indices of the two farthest points.
+ */
+double
+get_convhull_diam (double *xs, double *ys, int *conv_indices,
+                   int *far1, int *far2)
+{
+  int convind_sz;
+  for (convind_sz = 0; conv_indices[convind_sz] != -1; convind_sz++)
+    ;
+
+  if (far1 != NULL)
+    *far1 = conv_indices[0];
+  if (far2 != NULL)
+    *far2 = conv_indices[0];
+
+  if (convind_sz < 2)
+    return 0;
+
+  /*
+   * Rotating calipers: for each hull edge, advance
+   * the opposite caliper while that increases its
+   * distance from the edge. Every antipodal pair is
+   * visited once, so this is linear in the hull size.
+   * Points the caliper passes are checked against both
+   * ends of the edge too, since where two are about as
+   * far from the edge, rounding may pick either.
+   */
+  double sqdist_max = 0;
+  int j = 1;
+
+  for (int i = 0; i < convind_sz; i++)
+  {
+    int p1 = conv_indices[i];
+    int p2 = conv_indices[(i + 1) % convind_sz];
+
+    while (1)
+    {
+      int q1 = conv_indices[j];
+      int q2 = conv_indices[(j + 1) % convind_sz];
+      double sqdist1 = _square_dist (xs[p1], xs[q1], ys[p1], ys[q1]);
+      double sqdist2 = _square_dist (xs[p2], xs[q1], ys[p2], ys[q1]);
+
+      if (sqdist1 > sqdist_max)
+      {
+        sqdist_max = sqdist1;
+        if (far1 != NULL)
+          *far1 = p1;
+        if (far2 != NULL)
+          *far2 = q1;
+      }
+      if (sqdist2 > sqdist_max)
+      {
+        sqdist_max = sqdist2;
+        if (far1 != NULL)
+          *far1 = p2;
+        if (far2 != NULL)
+          *far2 = q1;
+      }
+
+      if (fabs (_cross (xs[p1], ys[p1], xs[p2], ys[p2], xs[q2], ys[q2]))
+          <= fabs (_cross (xs[p1], ys[p1], xs[p2], ys[p2], xs[q1], ys[q1])))
+        break;
+      j = (j + 1) % convind_sz;
+    }
+  }
+
+  return sqrt (sqdist_max);
+}
+
+/*
+ * compute_crown_profile:
+ * Find the crown diameter at each bucket above
+ * the highest trunk bucket, both for the bucket
+ * alone and for everything from it to the treetop,
+ * lowest bucket first. The profile arrays are
+ * allocated for the caller, unless bucket_diams_out
+ * and cum_diams_out are NULL. The max branch
+ * diameter and its interval go in maxdiam and
+ * maxdiam_ci. The data is only read, so this may
+ * run on several threads at once.
+ */
+void
+compute_crown_profile (tree_pointdata_t *data, int max_trunkbucket,
+                       double **bucket_diams_out, double **cum_diams_out,
+                       double *maxdiam, conf_int_t *maxdiam_ci)
+{
+  /*
+   * Rather than taking one hull of the whole bush,
+   * we walk down from the treetop, merging each
+   * bucket's hull into a running hull of all buckets
+   * above it. Only hull corners survive each merge,
+   * so every step works on a handful of points plus
+   * the new bucket, and the whole profile costs about
+   * as much as a single hull. The bottom entry of the
+   * cumulative profile is the hull of the whole bush.
+   */
+  unsigned int num_crown = data->z_num_buckets - 1 - max_trunkbucket;
+  int crown_base_bucket = max_trunkbucket + 1;
+  double *bucket_diams, *cum_diams;
+
+  _safe_malloc (bucket_diams, sizeof (double) * (num_crown + 1));
+  _safe_malloc (cum_diams, sizeof (double) * (num_crown + 1));
+
+  /* Corners of the running hull, and room to merge a bucket into it. */
+  double *cum_xs, *cum_ys;
+  double *merge_xs, *merge_ys;
+  int cum_sz = 0;
+  int merge_cap = data->params.zbucket_size;
+  double far1_x = 0, far1_y = 0, far2_x = 0, far2_y = 0;
+  bool sampled = false;
+
+  _safe_malloc (cum_xs, sizeof (double) * merge_cap);
+  _safe_malloc (cum_ys, sizeof (double) * merge_cap);
+  _safe_malloc (merge_xs, sizeof (double) * merge_cap);
+  _safe_malloc (merge_ys, sizeof (double) * merge_cap);
+
+  for (int curr = data->z_num_buckets - 1; curr > max_trunkbucket; curr--)
+  {
+    int crown_ind = curr - crown_base_bucket;
+    double *bucket_xs = data->x_z_bucket[curr];
+    double *bucket_ys = data->y_z_bucket[curr];
+
+    int *bucket_hull = get_convhull_indices (bucket_xs, bucket_ys,
+                                             data->z_bucket_stored[curr]);
+    bucket_diams[crown_ind] = get_convhull_diam (
+        bucket_xs, bucket_ys, bucket_hull, NULL, NULL);
+
+    if (data->z_bucket_stored[curr] < data->z_bucket_lengths[curr])
+      sampled = true;
+
+    int bucket_hull_sz;
+    for (bucket_hull_sz = 0; bucket_hull[bucket_hull_sz] != -1; bucket_hull_sz++)
+      ;
+
+    if (cum_sz + bucket_hull_sz > merge_cap)
+    {
+      merge_cap = cum_sz + bucket_hull_sz;
+      _safe_realloc (cum_xs, sizeof (double) * merge_cap);
+      _safe_realloc (cum_ys, sizeof (double) * merge_cap);
+      _safe_realloc (merge_xs, sizeof (double) * merge_cap);
+      _safe_realloc (merge_ys, sizeof (double) * merge_cap);
+    }
+
+    /* Merge corners of the running hull with this bucket's corners. */
+    int merge_sz = 0;
+    for (int i = 0; i < cum_sz; i++, merge_sz++)
+    {
+      merge_xs[merge_sz] = cum_xs[i];
+      merge_ys[merge_sz] = cum_ys[i];
+    }
+    for (int i = 0; i < bucket_hull_sz; i++, merge_sz++)
+    {
+      merge_xs[merge_sz] = bucket_xs[bucket_hull[i]];
+      merge_ys[merge_sz] = bucket_ys[bucket_hull[i]];
+    }
+
+    int *merge_hull = get_convhull_indices (merge_xs, merge_ys, merge_sz);
+    int far1, far2;
+    cum_diams[crown_ind] = get_convhull_diam (
+        merge_xs, merge_ys, merge_hull, &far1, &far2);
+
+    if (merge_sz > 0)
+    {
+      far1_x = merge_xs[far1];
+      far1_y = merge_ys[far1];
+      far2_x = merge_xs[far2];
+      far2_y = merge_ys[far2];
+    }
+
+    for (cum_sz = 0; merge_hull[cum_sz] != -1; cum_sz++)
+    {
+      cum_xs[cum_sz] = merge_xs[merge_hull[cum_sz]];
+      cum_ys[cum_sz] = merge_ys[merge_hull[cum_sz]];
+    }
+
+    free (bucket_hull);
+    free (merge_hull);
+  }
+
+  free (cum_xs);
+  free (cum_ys);
+  free (merge_xs);
+  free (merge_ys);
+
+  *maxdiam = (num_crown > 0) ? cum_diams[0] : 0;
+  maxdiam_ci->lo = *maxdiam;
+  maxdiam_ci->hi = *maxdiam;
+
+  if (bucket_diams_out != NULL && cum_diams_out != NULL)
+  {
+    *bucket_diams_out = bucket_diams;
+    *cum_diams_out = cum_diams;
+  }
+  else
+  {
+    free (bucket_diams);
+    free (cum_diams);
+  }
+
+  if (!sampled || *maxdiam == 0)
+    return;
+
+  /*
+   * On a sample, the hull diameter can only fall
+   * short. To bound by how much, project the sampled
+   * crown onto the axis of its diameter and extend
+   * each end by its Robson-Whitlock bound, splitting
+   * alpha between the two ends. This only accounts
+   * for points missed along that axis.
+   */
+  double axis_x = (far2_x - far1_x) / *maxdiam;
+  double axis_y = (far2_y - far1_y) / *maxdiam;
+  double top1 = -INFINITY, top2 = -INFINITY;
+  double bottom1 = INFINITY, bottom2 = INFINITY;
+
+  for (int curr = data->z_num_buckets - 1; curr > max_trunkbucket; curr--)
+  {
+    for (int i = 0; i < data->z_bucket_stored[curr]; i++)
+    {
+      double t = ((data->x_z_bucket[curr][i] - far1_x) * axis_x)
+                 + ((data->y_z_bucket[curr][i] - far1_y) * axis_y);
+      if (t > top1)
+      {
+        top2 = top1;
+        top1 = t;
+      }
+      else if (t > top2)
+        top2 = t;
+      if (t < bottom1)
+      {
+        bottom2 = bottom1;
+        bottom1 = t;
+      }
+      else if (t < bottom2)
+        bottom2 = t;
+    }
+  }
+
+  if (isfinite (top2) && isfinite (bottom2))
+    maxdiam_ci->hi =
+        _max_upper_bound (top1, top2, APPROX_CONF_ALPHA / 2)
+        + _max_upper_bound (-bottom1, -bottom2, APPROX_CONF_ALPHA / 2);
+}
+
+/*
+ * _is_trunk_bucket:
+ * Check whether a bucket, scanning from the top
+ * down, could be the highest trunk bucket: close in
+ * size to the bucket above it, and far smaller than
+ * the largest bucket seen so far.
+ */
+bool
+_is_trunk_bucket (unsigned int count, unsigned int prev_count,
+                  unsigned int max_count, const tree_params_t *params)
+{
+  int diff = count - prev_count;
+  double ratio_diff = fabs(((double) diff) / ((double) count));
+  if (ratio_diff <= params->trunk_diff_thresh)
+  {
+    int max_diff = max_count - count;
+    double ratio_maxdiff = fabs(((double) max_diff) / ((double) count));
+    return ratio_maxdiff >= params->trunk_maxdiff_thresh;
+  }
+  return false;
+}
+
+/*
+ * find_trunk_top:
+ * Find the highest trunk bucket, or -1 if
+ * there is none.
+ */
+int
+find_trunk_top (tree_pointdata_t *data, const tree_params_t *params)
+{
+  /*
+   * We scan down from the top, tracking the largest
+   * bucket seen so far. A bucket can only be the trunk
+   * top if it is far smaller than that largest bucket,
+   * so where a whole pyramid node is too close in size
+   * to it (and to its own largest bucket), no bucket in
+   * the node can qualify and we step over it at once.
+   * This skips most of the crown in one or two steps,
+   * and finds the same bucket a plain scan would.
+   */
+  zbucket_pyramid_t *pyr = &data->pyramid;
+  unsigned int *counts = data->z_bucket_lengths;
+  int num_buckets = data->z_num_buckets;
+
+  if (num_buckets < 2)
+    return -1;
+
+  unsigned int max_count = counts[num_buckets - 1];
+  unsigned int prev_count = counts[num_buckets - 1];
+  int curr = num_buckets - 2;
+
+  while (curr >= 0)
+  {
+    bool skipped = false;
+
+    /* Try the coarsest node whose top bucket is curr first. */
+    for (int k = pyr->num_levels - 1; k > 0 && !skipped; k--)
+    {
+      int width = 1 << k;
+      if ((curr + 1) % width != 0)
+        continue;
+
+      int node = ((curr + 1) / width) - 1;
+      unsigned int node_min = pyr->mins[k][node];
+      unsigned int bound = (pyr->maxs[k][node] > max_count)
+                           ? pyr->maxs[k][node] : max_count;
+
+      if (node_min > 0
+          && (((double) (bound - node_min)) / ((double) node_min))
+             < params->trunk_maxdiff_thresh)
+      {
+        max_count = bound;
+        prev_count = counts[curr + 1 - width];
+        curr -= width;
+        skipped = true;
+      }
+    }
+    if (skipped)
+      continue;
+
+    if (counts[curr] >= max_count)
+      max_count = counts[curr];
+    else if (_is_trunk_bucket (counts[curr], prev_count, max_count, params))
+      return curr;
+
+    prev_count = counts[curr];
+    curr--;
+  }
+
+  return -1;
+}
+
+/*
+ * skip_similar_buckets:
+ * From a bucket downwards, find the highest bucket
+ * whose count is not within a portion thresh of
+ * ref_count, or -1 if there is none.
+ */
+int
+skip_similar_buckets (tree_pointdata_t *data, int curr,
+                      double ref_count, double thresh)
+{
+  /*
+   * As in find_trunk_top, a pyramid node whose least
+   * and greatest buckets are both close to ref_count
+   * is stepped over whole.
+   */
+  zbucket_pyramid_t *pyr = &data->pyramid;
+  double margin = thresh * ref_count;
+
+  while (curr >= 0)
+  {
+    bool skipped = false;
+
+    for (int k = pyr->num_levels - 1; k >= 0 && !skipped; k--)
+    {
+      int width = 1 << k;
+      if ((curr + 1) % width != 0)
+        continue;
+
+      int node = ((curr + 1) / width) - 1;
+      if (fabs (pyr->maxs[k][node] - ref_count) < margin
+          && fabs (pyr->mins[k][node] - ref_count) < margin)
+      {
+        curr -= width;
+        skipped = true;
+      }
+    }
+    if (!skipped)
+      return curr;
+  }
+
+  return -1;
+}
+
+/*
+ * _in_circ:
+ * Check whether a point lies in a circle, allowing
+ * for rounding on its boundary.
+ */
+bool
+_in_circ (const circ_t *circ, double px, double py)
+{
+  return _square_dist (px, circ->x, py, circ->y)
+         <= (circ->rad * circ->rad * (1 + 1e-12)) + 1e-18;
+}
+
+/*
+ * _circumcircle:
+ * Find the circle through three points. Returns
+ * false, leaving circ as it was, if they are
+ * collinear.
+ */
+bool
+_circumcircle (double x1, double y1, double x2, double y2,
+               double x3, double y3, circ_t *circ)
+{
+  double bx = x2 - x1, by = y2 - y1;
+  double cx = x3 - x1, cy = y3 - y1;
+  double det = 2 * ((bx * cy) - (by * cx));
+
+  if (fabs (det) < 1e-18)
+    return false;
+
+  double b_sq = (bx * bx) + (by * by);
+  double c_sq = (cx * cx) + (cy * cy);
+  double ux = ((cy * b_sq) - (by * c_sq)) / det;
+  double uy = ((bx * c_sq) - (cx * b_sq)) / det;
+
+  circ->x = x1 + ux;
+  circ->y = y1 + uy;
+  circ->rad = sqrt ((ux * ux) + (uy * uy));
+  return true;
+}
+
+/*
+ * _diam_circ:
+ * Find the circle with two points as its diameter.
+ */
+circ_t
+_diam_circ (double x1, double y1, double x2, double y2)
+{
+  circ_t circ;
+
+  circ.x = (x1 + x2) / 2;
+  circ.y = (y1 + y2) / 2;
+  circ.rad = sqrt (_square_dist (x1, x2, y1, y2)) / 2;
+  return circ;
+}
+
+/*
+ * _trunk_ci_from_max:
+ * Bound the diameter of a circle whose radius is a
+ * largest distance from its centre, if the bucket
+ * was sampled. next_rad is the next largest distance.
+ */
+void
+_trunk_ci_from_max (tree_pointdata_t *data, int bucket,
+                    double rad, double next_rad, trunk_t *trunk)
+{
+  trunk->diam_ci.lo = 2 * rad;
+  trunk->diam_ci.hi = 2 * rad;
+  if (data->z_bucket_stored[bucket] < data->z_bucket_lengths[bucket])
+    trunk->diam_ci.hi = 2 * _max_upper_bound (rad, next_rad,
+                                              APPROX_CONF_ALPHA);
+}
+
+/*
+ * fit_trunk_centroid:
+ * Fit the trunk as the circle about the centroid
+ * of a bucket reaching its farthest point.
+ */
+void
+fit_trunk_centroid (tree_pointdata_t *data, int bucket, trunk_t *trunk)
+{
+  double trunk_avg_x = 0, trunk_avg_y = 0;
+  double trunk_max_dist = 0;
+  double trunk_next_dist = 0;
+  unsigned int trunk_stored = data->z_bucket_stored[bucket];
+
+  for (int i = 0; i < trunk_stored; i++)
+  {
+    trunk_avg_x += data->x_z_bucket[bucket][i];
+    trunk_avg_y += data->y_z_bucket[bucket][i];
+  }
+
+  trunk_avg_x /= trunk_stored;
+  trunk_avg_y /= trunk_stored;
+
+  for (int i = 0; i < trunk_stored; i++)
+  {
+    double sqdist = _square_dist (
+        data->x_z_bucket[bucket][i], trunk_avg_x,
+        data->y_z_bucket[bucket][i], trunk_avg_y
+        );
+    if (sqdist >= trunk_max_dist)
+    {
+      trunk_next_dist = trunk_max_dist;
+      trunk_max_dist = sqdist;
+    }
+    else if (sqdist > trunk_next_dist)
+      trunk_next_dist = sqdist;
+  }
+
+  trunk->circ.x = trunk_avg_x;
+  trunk->circ.y = trunk_avg_y;
+  trunk->circ.rad = sqrt (trunk_max_dist);
+
+  /*
+   * If the trunk bucket was sampled, the farthest
+   * point may have been missed, so bound the radius
+   * from the two farthest points we did keep.
+   */
+  _trunk_ci_from_max (data, bucket, trunk->circ.rad, sqrt (trunk_next_dist),
+                      trunk);
+
+  if (trunk_stored < data->z_bucket_lengths[bucket])
+  {
+    /*
+     * The sampled centroid is off too, by about its
+     * standard error (with finite population correction),
+     * which moves every distance by up to as much.
+     */
+    double var = 0;
+    for (int i = 0; i < trunk_stored; i++)
+      var += _square_dist (
+          data->x_z_bucket[bucket][i], trunk_avg_x,
+          data->y_z_bucket[bucket][i], trunk_avg_y);
+    var /= (trunk_stored > 1) ? (trunk_stored - 1) : 1;
+
+    double centroid_err = APPROX_CONF_Z * sqrt (
+        (var / trunk_stored)
+        * (1 - ((double) trunk_stored) / data->z_bucket_lengths[bucket]));
+
+    trunk->diam_ci.lo -= 2 * centroid_err;
+    trunk->diam_ci.hi += 2 * centroid_err;
+  }
+}
+
+/*
+ * fit_trunk_mec:
+ * Fit the trunk as the minimum enclosing circle
+ * of a bucket, by Welzl's algorithm.
+ */
+void
+fit_trunk_mec (tree_pointdata_t *data, int bucket, trunk_t *trunk)
+{
+  /*
+   * We use the iterative form of Welzl's algorithm:
+   * after shuffling, each point outside the circle so
+   * far must lie on the boundary of the circle of all
+   * points up to it, so we rebuild the circle with that
+   * point fixed, and likewise for a second and third
+   * point. A point only triggers a rebuild with small
+   * probability, so this takes expected linear time.
+   */
+  unsigned int count = data->z_bucket_stored[bucket];
+  double *xs, *ys;
+  unsigned long long rand_state = RAND_SEED;
+
+  _safe_malloc (xs, sizeof (double) * count);
+  _safe_malloc (ys, sizeof (double) * count);
+
+  for (int i = 0; i < count; i++)
+  {
+    xs[i] = data->x_z_bucket[bucket][i];
+    ys[i] = data->y_z_bucket[bucket][i];
+  }
+
+  /* Shuffle without touching the buckets, which may be shared. */
+  for (int i = count - 1; i > 0; i--)
+  {
+    int j = _rand_next (&rand_state) % (i + 1);
+    double tmp_x = xs[i], tmp_y = ys[i];
+    xs[i] = xs[j];
+    ys[i] = ys[j];
+    xs[j] = tmp_x;
+    ys[j] = tmp_y;
+  }
+
+  circ_t circ = { xs[0], ys[0], 0 };
+
+  for (int i = 1; i < count; i++)
+  {
+    if (_in_circ (&circ, xs[i], ys[i]))
+      continue;
+
+    circ.x = xs[i];
+    circ.y = ys[i];
+    circ.rad = 0;
+
+    for (int j = 0; j < i; j++)
+    {
+      if (_in_circ (&circ, xs[j], ys[j]))
+        continue;
+
+      circ = _diam_circ (xs[i], ys[i], xs[j], ys[j]);
+
+      for (int k = 0; k < j; k++)
+      {
+        if (_in_circ (&circ, xs[k], ys[k]))
+          continue;
+
+        /* Collinear: the farthest pair of the three spans it. */
+        if (!_circumcircle (xs[i], ys[i], xs[j], ys[j], xs[k], ys[k], &circ))
+        {
+          circ_t ik = _diam_circ (xs[i], ys[i], xs[k], ys[k]);
+          circ_t jk = _diam_circ (xs[j], ys[j], xs[k], ys[k]);
+          circ = (ik.rad > jk.rad) ? ik : jk;
+        }
+      }
+    }
+  }
+
+  trunk->circ = circ;
+
+  /*
+   * A sample's enclosing circle can only be smaller,
+   * so it is the lower bound. Its boundary points tie
+   * for farthest, so the upper bound uses the farthest
+   * point strictly inside it.
+   */
+  double next_dist = 0;
+  for (int i = 0; i < count; i++)
+  {
+    double dist = sqrt (_square_dist (xs[i], circ.x, ys[i], circ.y));
+    if (dist < circ.rad * (1 - 1e-9) && dist > next_dist)
+      next_dist = dist;
+  }
+  _trunk_ci_from_max (data, bucket, circ.rad, next_dist, trunk);
+
+  free (xs);
+  free (ys);
+}
+
+/*
+ * _ransac_fit_bucket:
+ * Fit a circle to one bucket by RANSAC, filling
+ * in a ransac_job_t. Run on its own thread.
+ */
+void *
+_ransac_fit_bucket (void *arg)
+{
+  ransac_job_t *job = (ransac_job_t *) arg;
+  tree_pointdata_t *data = job->data;
+  double *xs = data->x_z_bucket[job->bucket];
+  double *ys = data->y_z_bucket[job->bucket];
+  unsigned int count = data->z_bucket_stored[job->bucket];
+  trunk_t enclosing;
+  unsigned long long rand_state = RAND_SEED ^ ((job->bucket + 1) * 0x2545f4914f6cdd1dULL);
+
+  job->ok = false;
+  job->inliers = 0;
+
+  if (count < 3)
+    return NULL;
+
+  /*
+   * Three close points on the trunk can give a huge
+   * circle, so the tolerance is a portion of the
+   * bucket's enclosing radius rather than of each
+   * candidate's, and no candidate may be larger than
+   * the enclosing circle.
+   */
+  fit_trunk_mec (data, job->bucket, &enclosing);
+  double max_rad = enclosing.circ.rad;
+  double tol = job->params->ransac_inlier_tol * max_rad;
+
+  /*
+   * Fit circles through random triples, keeping the
+   * one most points lie near. Once the best fit has an
+   * inlier portion w, a triple of inliers turns up within
+   * log(1 - p) / log(1 - w^3) tries with probability p,
+   * so we stop there rather than at a fixed count.
+   */
+  circ_t best;
+  unsigned int best_inliers = 0;
+  unsigned int iters_needed = RANSAC_MAX_ITERS;
+
+  for (unsigned int it = 0; it < iters_needed; it++)
+  {
+    int i = _rand_next (&rand_state) % count;
+    int j = _rand_next (&rand_state) % count;
+    int k = _rand_next (&rand_state) % count;
+    circ_t circ;
+
+    if (i == j || j == k || i == k
+        || !_circumcircle (xs[i], ys[i], xs[j], ys[j], xs[k], ys[k], &circ)
+        || circ.rad > max_rad)
+      continue;
+
+    unsigned int inliers = 0;
+    for (int p = 0; p < count; p++)
+    {
+      double dist = sqrt (_square_dist (xs[p], circ.x, ys[p], circ.y));
+      if (fabs (dist - circ.rad) <= tol)
+        inliers++;
+    }
+
+    if (inliers > best_inliers)
+    {
+      best = circ;
+      best_inliers = inliers;
+
+      double w = ((double) inliers) / count;
+      if (w >= 1)
+        iters_needed = it + 1;
+      else
+      {
+        double needed = log (1 - RANSAC_CONFIDENCE) / log (1 - (w * w * w));
+        if (needed < iters_needed)
+          iters_needed = (unsigned int) ceil (needed);
+      }
+    }
+  }
+
+  if (best_inliers == 0)
+    return NULL;
+
+  /* Refit the radius to the inliers, and see how widely they spread. */
+  double sum_dist = 0, sum_sq_dist = 0;
+  for (int p = 0; p < count; p++)
+  {
+    double dist = sqrt (_square_dist (xs[p], best.x, ys[p], best.y));
+    if (fabs (dist - best.rad) <= tol)
+    {
+      sum_dist += dist;
+      sum_sq_dist += dist * dist;
+    }
+  }
+
+  job->circ = best;
+  job->circ.rad = sum_dist / best_inliers;
+  job->rad_var = (best_inliers > 1)
+                 ? fmax (0, (sum_sq_dist - (sum_dist * job->circ.rad))
+                            / (best_inliers - 1))
+                 : 0;
+
+  job->band = 0;
+  for (int p = 0; p < count; p++)
+  {
+    double dist = sqrt (_square_dist (xs[p], best.x, ys[p], best.y));
+    if (fabs (dist - best.rad) <= tol
+        && fabs (dist - job->circ.rad) > job->band)
+      job->band = fabs (dist - job->circ.rad);
+  }
+
+  job->inliers = best_inliers;
+  job->ok = true;
+  return NULL;
 }
 
 /*
- * cmp_cos_indices:
- * Compare two points, reformed as cmp_val_t
- * values, by the cosine of their angles
- * to the origin.
+ * _cmp_ransac_rad:
+ * Compare two RANSAC jobs by fitted radius,
+ * failed fits last.
  */
 int
-cmp_cos_indices (const void *v1, const void *v2)
+_cmp_ransac_rad (const void *v1, const void *v2)
 {
-  cmp_val_t *ind1 = (cmp_val_t *) v1;
-  cmp_val_t *ind2 = (cmp_val_t *) v2;
-
-  double cos1 = cos_from_xaxis (ind1->x, ind1->y);
-  double cos2 = cos_from_xaxis (ind2->x, ind2->y);
+  const ransac_job_t *job1 = (const ransac_job_t *) v1;
+  const ransac_job_t *job2 = (const ransac_job_t *) v2;
 
-  if (cos1 < cos2)
+  if (job1->ok != job2->ok)
+    return job1->ok ? -1 : 1;
+  if (job1->circ.rad < job2->circ.rad)
     return -1;
-  else if (cos1 == cos2)
+  else if (job1->circ.rad == job2->circ.rad)
     return 0;
   else
     return 1;
 }
 
 /*
- * get_convhull_indices:
- * Get all indices of points in the convex hull
- * of a set of points.
+ * fit_trunk_ransac:
+ * Fit the trunk by RANSAC over several buckets
+ * from the highest trunk bucket down, one thread
+ * per bucket. Returns false if no bucket could
+ * be fitted.
  */
-int *
-get_convhull_indices (double *xs, double *ys, int count)
+bool
+fit_trunk_ransac (tree_pointdata_t *data, int bucket,
+                  const tree_params_t *params, trunk_t *trunk)
 {
-  /*
-   * Our algorithm is O(nlogn) complexity. We
-   * sort the points by their angle to the lowest
-   * point Y-axis-wise, then accumulate points into
-   * the hull in this order, removing previous points
-   * if they make a concave angle to the current one.
-   */
-  double lowest_x, lowest_y;
-  double max_dist, farthest_x, farthest_y;
+  int num_jobs = (params->ransac_buckets <= bucket + 1)
+                 ? params->ransac_buckets : (bucket + 1);
+  ransac_job_t *jobs;
+  pthread_t *threads;
 
-  for (int i = 0; i < count; i++)
+  _safe_malloc (jobs, sizeof (ransac_job_t) * num_jobs);
+  _safe_malloc (threads, sizeof (pthread_t) * params->num_threads);
+
+  for (int i = 0; i < num_jobs; i++)
   {
-    if (ys[i] <= lowest_y)
-    {
-      lowest_x = xs[i];
-      lowest_y = ys[i];
-    }
+    jobs[i].data = data;
+    jobs[i].params = params;
+    jobs[i].bucket = bucket - i;
+  }
+
+  /* Run jobs in batches of at most num_threads. */
+  for (int first = 0; first < num_jobs; first += params->num_threads)
+  {
+    int batch = num_jobs - first;
+    if (batch > params->num_threads)
+      batch = params->num_threads;
+
+    for (int t = 0; t < batch; t++)
+      if (pthread_create (&threads[t], NULL, _ransac_fit_bucket,
+                          &jobs[first + t]) != 0)
+        _EXIT_FAIL ("Error in fit_trunk_ransac on creating thread")
+    for (int t = 0; t < batch; t++)
+      pthread_join (threads[t], NULL);
   }
 
   /*
-   * Quicksort xs and ys in-place by angle to
-   * (lowest_x, lowest_y).
-   * We need to produce comparable values rather
-   * than two arrays, and need to zero-adjust them
-   * so the lowest point is at the origin. (This will
-   * have no impact on later computations, as we are
-   * merely producing a list of indices.)
+   * Take the median radius across buckets, so one
+   * bucket with a branch stub can't skew it. Its
+   * inliers set the band the ground search allows
+   * around the trunk, in place of a fixed margin.
    */
-  cmp_val_t *sort_vals;
-  _safe_malloc (sort_vals, sizeof (cmp_val_t) * count);
+  qsort (jobs, num_jobs, sizeof (ransac_job_t), _cmp_ransac_rad);
 
-  for (int i = 0; i < count; i++)
+  int num_ok;
+  for (num_ok = 0; num_ok < num_jobs && jobs[num_ok].ok; num_ok++)
+    ;
+
+  if (num_ok == 0)
   {
-    sort_vals[i].ind = i;
-    sort_vals[i].x = xs[i] - lowest_x;
-    sort_vals[i].y = ys[i] - lowest_y;
+    free (jobs);
+    free (threads);
+    return false;
   }
 
-  qsort ((void *) sort_vals, count, sizeof (cmp_val_t), cmp_cos_indices);
+  ransac_job_t *median = &jobs[(num_ok - 1) / 2];
 
-  bool *in_convhull;
-  int convhull_sz = count;
-  _safe_malloc (in_convhull, sizeof (bool) * count);
+  trunk->circ = median->circ;
+  trunk->err_circ = median->circ;
+  trunk->err_circ.rad += median->band;
 
   /*
-   * Now iterate through all points, checking if they
-   * are in the hull or not.
+   * The ground search counts the points in the whole
+   * disk out to the farthest inlier, not just those
+   * near the circle, so take the reference count over
+   * the same disk in the fitted buckets.
    */
-  in_convhull[0] = true;
-  in_convhull[1] = true;
-
-  for (int i = 2; i < count; i++)
+  trunk->ref_count = 0;
+  for (int i = 0; i < num_ok; i++)
   {
-    in_convhull[i] = true;
-    /*
-     * At each new point, we expect the next angle to give a
-     * 'left turn' of angle as we go. We can find if this is
-     * true by, for current point p1, prev point p2 and earlier
-     * point p3, taking the z-coordinate of the cross product
-     * of p1->p3 and p1->p2. If negative, it is a right turn
-     * and thus p2 is not in the convex hull. (This might take
-     * drawing out to better visualize!)
-     */
-    int prev1 = i - 1;
-    while (!in_convhull[prev1] && prev1 > 0)
-      prev1--;
-    int prev2 = prev1 - 1;
-    while (!in_convhull[prev2] && prev2 > 0)
-      prev2--;
-    /* while cross prod < 0 */
-    while (((sort_vals[prev2].x - sort_vals[i].x)
-            * (sort_vals[prev1].y - sort_vals[i].y))
-           < ((sort_vals[prev2].y - sort_vals[i].y)
-              * (sort_vals[prev1].x - sort_vals[i].x)))
-    {
-      in_convhull[prev1] = false;
-      convhull_sz--;
-      while (!in_convhull[prev1] && prev1 > 0)
-        prev1--;
-      prev2 = (prev1 == 0) ? 0 : (prev1 - 1);
-      while (!in_convhull[prev2] && prev2 > 0)
-        prev2--;
-      if (prev1 == 0)
-        break;
-    }
-  }
+    int curr = jobs[i].bucket;
+    unsigned int in_circ = 0;
 
-  /*
-   * Finally, accumulate points in convex hull in a
-   * -1-terminated list of indices.
-   */
+    for (int p = 0; p < data->z_bucket_stored[curr]; p++)
+      if (_square_dist (data->x_z_bucket[curr][p], trunk->err_circ.x,
+                        data->y_z_bucket[curr][p], trunk->err_circ.y)
+          < trunk->err_circ.rad * trunk->err_circ.rad)
+        in_circ++;
 
-  int *conv_indices;
-  int convindices_top = 0;
-  _safe_malloc (conv_indices, sizeof (int) * (convhull_sz + 1));
+    trunk->ref_count += ((double) in_circ) * data->z_bucket_lengths[curr]
+                        / data->z_bucket_stored[curr];
+  }
+  trunk->ref_count /= num_ok;
 
-  for (int i = 0; i < convhull_sz; i++)
+  /* On a sample, the radius is a mean, so bound it by its standard error. */
+  trunk->diam_ci.lo = 2 * trunk->circ.rad;
+  trunk->diam_ci.hi = 2 * trunk->circ.rad;
+  if (data->z_bucket_stored[median->bucket]
+      < data->z_bucket_lengths[median->bucket])
   {
-    if (in_convhull[i])
-    {
-      conv_indices[convindices_top] = sort_vals[i].ind;
-      convindices_top++;
-    }
+    double rad_err = APPROX_CONF_Z * sqrt (median->rad_var / median->inliers);
+    trunk->diam_ci.lo -= 2 * rad_err;
+    trunk->diam_ci.hi += 2 * rad_err;
   }
-  conv_indices[convindices_top] = -1;
 
-  return conv_indices;
+  free (jobs);
+  free (threads);
+  return true;
 }
 
 /*
- * process_tree_pointdata:
- * Process the data to find the trunk, max branch
- * and vertical lengths of the tree. This is all
- * done in one function as they are all
- * intertwined operations.
+ * set_trunk_margin:
+ * Set the circle the ground search counts points
+ * in, from a fitted trunk, unless RANSAC already
+ * set it from its inliers.
  */
 void
-process_tree_pointdata (tree_pointdata_t *data)
+set_trunk_margin (trunk_t *trunk, const tree_params_t *params)
 {
-  int curr_maxbucket = data->z_num_buckets - 1;
-  int max_trunkbucket = -1;
+  if (trunk->inlier_band)
+    return;
 
-  int curr = data->z_num_buckets - 2;
-  int prev = data->z_num_buckets - 1;
-
-  int bush_size = data->z_num_buckets - 1;
+  trunk->err_circ = trunk->circ;
+  trunk->err_circ.rad *= 1 + params->trunk_circ_margin;
+}
 
-  /* Find the highest trunk bucket. */
-  for (; curr >= 0; curr--)
+/*
+ * fit_trunk:
+ * Fit a circle to the trunk at its highest bucket,
+ * by the method set in params.
+ */
+void
+fit_trunk (tree_pointdata_t *data, int bucket, const tree_params_t *params,
+           trunk_t *trunk)
+{
+  if (params->trunk_fit == TRUNK_FIT_RANSAC
+      && fit_trunk_ransac (data, bucket, params, trunk))
   {
-    if (data->z_bucket_lengths[curr] >= data->z_bucket_lengths[curr_maxbucket])
-      curr_maxbucket = curr;
-    else
-    {
-      int diff = data->z_bucket_lengths[curr] - data->z_bucket_lengths[prev];
-      double ratio_diff = fabs(((double) diff) / ((double) data->z_bucket_lengths[curr]));
-      if (ratio_diff <= TRUNK_BUCKET_DIFF_THRESH)
-      {
-        int max_diff = data->z_bucket_lengths[curr_maxbucket]
-                       - data->z_bucket_lengths[curr];
-        double ratio_maxdiff = fabs(((double) max_diff)
-                                    / ((double) data->z_bucket_lengths[curr]));
-        if (ratio_maxdiff >= TRUNK_BUCKET_MAXDIFF_THRESH)
-        {
-          /* We have reached the highest trunk bucket */
-          max_trunkbucket = curr;
-          break;
-        }
-      }
-    }
-
-    prev = curr;
-    bush_size += data->z_bucket_lengths[curr];
+    trunk->inlier_band = true;
+    return;
   }
 
-  if (max_trunkbucket == -1)
-    _EXIT_FAIL ("Error in process_tree_pointdata from failing to find trunk top")
+  if (params->trunk_fit == TRUNK_FIT_CENTROID)
+    fit_trunk_centroid (data, bucket, trunk);
+  else
+    fit_trunk_mec (data, bucket, trunk);
 
-  /* Find trunk diameter */
+  /*
+   * For these methods, the ground search allows a
+   * fixed margin around the trunk, and expects as
+   * many points in it as the whole trunk bucket.
+   */
+  trunk->inlier_band = false;
+  trunk->ref_count = data->z_bucket_lengths[bucket];
+  set_trunk_margin (trunk, params);
+}
 
-  double trunk_avg_x, trunk_avg_y;
-  double trunk_farthest_x, trunk_farthest_y;
-  double trunk_max_dist;
+/*
+ * _count_in_circ:
+ * Count the points of a bucket inside a circle,
+ * scaled up to the whole bucket if it was sampled.
+ * If count_ci is not NULL, it is set to an interval
+ * on the whole bucket's count, which is exact if the
+ * bucket was not sampled.
+ */
+double
+_count_in_circ (tree_pointdata_t *data, int bucket, const circ_t *circ,
+                conf_int_t *count_ci)
+{
+  unsigned int stored = data->z_bucket_stored[bucket];
+  unsigned int total = data->z_bucket_lengths[bucket];
+  unsigned int inside = 0;
 
-  for (int i = 0; i < data->z_bucket_lengths[max_trunkbucket]; i++)
+  for (int i = 0; i < stored; i++)
   {
-    trunk_avg_x += data->x_z_bucket[max_trunkbucket][i];
-    trunk_avg_y += data->y_z_bucket[max_trunkbucket][i];
+    double sqdist = _square_dist (
+        data->x_z_bucket[bucket][i], circ->x,
+        data->y_z_bucket[bucket][i], circ->y
+        );
+    if (sqdist < (circ->rad * circ->rad))
+      inside++;
   }
 
-  trunk_avg_x /= data->z_bucket_lengths[max_trunkbucket];
-  trunk_avg_y /= data->z_bucket_lengths[max_trunkbucket];
+  double count = (stored > 0) ? ((double) inside) * total / stored : 0;
 
-  for (int i = 0; i < data->z_bucket_lengths[max_trunkbucket]; i++)
+  if (count_ci == NULL)
+    return count;
+
+  count_ci->lo = count;
+  count_ci->hi = count;
+  if (stored < total && stored > 0)
   {
-    double sqdist = _square_dist (
-        data->x_z_bucket[max_trunkbucket][i],
-        trunk_avg_x,
-        data->y_z_bucket[max_trunkbucket][i],
-        trunk_avg_y
-        );
-    if (sqdist >= trunk_max_dist)
-    {
-      trunk_max_dist = sqdist;
-      trunk_farthest_x = data->x_z_bucket[max_trunkbucket][i];
-      trunk_farthest_y = data->y_z_bucket[max_trunkbucket][i];
-    }
+    /*
+     * Agresti-Coull interval on the portion inside,
+     * with the finite population correction, since the
+     * sample is drawn without replacement.
+     */
+    double z_sq = APPROX_CONF_Z * APPROX_CONF_Z;
+    double adj_n = stored + z_sq;
+    double adj_p = (inside + (z_sq / 2)) / adj_n;
+    double fpc = ((double) (total - stored)) / (total - 1);
+    double half = APPROX_CONF_Z * sqrt (adj_p * (1 - adj_p) * fpc / adj_n);
+
+    count_ci->lo = fmin (count, fmax (0, (adj_p - half) * total));
+    count_ci->hi = fmax (count, fmin (total, (adj_p + half) * total));
   }
 
-  /* Trunk diameter = diameter of smallest encompassing circle */
-  data->trunkdiam = 2 * sqrt (_square_dist (
-      trunk_farthest_x, trunk_avg_x,
-      trunk_farthest_y, trunk_avg_y
-      ));
+  return count;
+}
 
+/*
+ * find_height:
+ * Find the tree height, given the highest trunk
+ * bucket and the trunk fitted there.
+ */
+void
+find_height (tree_pointdata_t *data, int max_trunkbucket,
+             const tree_params_t *params, const trunk_t *trunk,
+             double *height, conf_int_t *height_ci)
+{
   /*
    * Find tree height
    * Do this in several stages:
@@ -431,51 +1791,70 @@ process_tree_pointdata (tree_pointdata_t *data)
    * where the ground starts appearing, even if far away.
    */
 
-  circ_t trunk_err_circ;
+  const circ_t *trunk_err_circ = &trunk->err_circ;
 
-  trunk_err_circ.x = trunk_avg_x;
-  trunk_err_circ.y = trunk_avg_y;
-  trunk_err_circ.rad = (data->trunkdiam / 2) * (1 + TRUNK_BUCKET_DIFF_THRESH);
+  double trunk_count = trunk->ref_count;
+  double count_margin = params->trunk_diff_thresh * trunk_count;
 
-  int curr_bucket = 0;
-
-  for (curr_bucket = max_trunkbucket;
-       abs (data->z_bucket_lengths[curr_bucket] - data->z_bucket_lengths[max_trunkbucket])
-       < (TRUNK_BUCKET_DIFF_THRESH * data->z_bucket_lengths[max_trunkbucket]);
-       curr_bucket--)
-    ;
+  int start_bucket = skip_similar_buckets (
+      data, max_trunkbucket, data->z_bucket_lengths[max_trunkbucket],
+      params->trunk_diff_thresh);
+  int curr_bucket = start_bucket;
 
   /* Search for bucket below start of ground where trunk ends  */
-  int in_trunkerr_count = data->z_bucket_lengths[max_trunkbucket];
+  int in_trunkerr_count = (int) round (trunk_count);
+  bool sampled = data->z_bucket_stored[max_trunkbucket]
+                 < data->z_bucket_lengths[max_trunkbucket];
   for (/**/
-      ; abs (in_trunkerr_count - data->z_bucket_lengths[max_trunkbucket])
-        < (TRUNK_BUCKET_DIFF_THRESH * data->z_bucket_lengths[max_trunkbucket])
+      ; (curr_bucket >= 0)
+        && (fabs (in_trunkerr_count - trunk_count) < count_margin)
       ; curr_bucket--)
   {
-    in_trunkerr_count = 0;
-    for (int i = 0; i < data->z_bucket_lengths[curr_bucket]; i++)
+    /*
+     * A bucket with too few points in total can't have
+     * enough inside the circle, so don't count them.
+     */
+    if (data->z_bucket_lengths[curr_bucket] <= trunk_count - count_margin)
     {
-      double sqdist = _square_dist (
-          data->x_z_bucket[curr_bucket][i], trunk_err_circ.x,
-          data->y_z_bucket[curr_bucket][i], trunk_err_circ.y
-          );
-      if (sqdist < (trunk_err_circ.rad * trunk_err_circ.rad))
-        in_trunkerr_count++;
+      in_trunkerr_count = data->z_bucket_lengths[curr_bucket];
+      continue;
     }
+
+    in_trunkerr_count = (int) round (
+        _count_in_circ (data, curr_bucket, trunk_err_circ, NULL));
+    if (data->z_bucket_stored[curr_bucket] < data->z_bucket_lengths[curr_bucket])
+      sampled = true;
   }
-  /* Go back to bucket that failed (decremented after failing iteration) */
-  curr_bucket += 2;
+  /*
+   * Go back to bucket that failed (decremented after failing
+   * iteration), unless we ran off the bottom with the trunk.
+   */
+  if (curr_bucket < 0 && fabs (in_trunkerr_count - trunk_count) < count_margin)
+    curr_bucket = 0;
+  else
+    curr_bucket += 2;
+  /*
+   * If no bucket was checked (no margin, or nothing below
+   * the skip), the start bucket failed, so the ground is
+   * no higher than the bucket above it.
+   */
+  if (curr_bucket > start_bucket + 1)
+    curr_bucket = start_bucket + 1;
+  if (curr_bucket < 0)
+    curr_bucket = 0;
+  if (curr_bucket > (int) data->z_num_buckets - 1)
+    curr_bucket = data->z_num_buckets - 1;
 
   /* Find closest point outside circle in bucket. Get its z-coordinate */
   double closest_outside_z = data->z_z_bucket[curr_bucket][0];
-  double closest_outside_dist = trunk_err_circ.rad * trunk_err_circ.rad * 16;
-  for (int i = 0; i < data->z_bucket_lengths[curr_bucket]; i++)
+  double closest_outside_dist = trunk_err_circ->rad * trunk_err_circ->rad * 16;
+  for (int i = 0; i < data->z_bucket_stored[curr_bucket]; i++)
   {
     double sqdist = _square_dist (
-        data->x_z_bucket[curr_bucket][i], trunk_err_circ.x,
-        data->y_z_bucket[curr_bucket][i], trunk_err_circ.y
+        data->x_z_bucket[curr_bucket][i], trunk_err_circ->x,
+        data->y_z_bucket[curr_bucket][i], trunk_err_circ->y
         );
-    if (sqdist > (trunk_err_circ.rad * trunk_err_circ.rad)
+    if (sqdist > (trunk_err_circ->rad * trunk_err_circ->rad)
         && sqdist < closest_outside_dist)
     {
       closest_outside_dist = sqdist;
@@ -483,84 +1862,110 @@ process_tree_pointdata (tree_pointdata_t *data)
     }
   }
 
-  data->treeheight = data->max_z - closest_outside_z;
+  *height = data->max_z - closest_outside_z;
 
-  /* Find max branch diameter */
-
-  double *bush_xs, *bush_ys;
+  height_ci->lo = *height;
+  height_ci->hi = *height;
+  if (!sampled
+      && data->z_bucket_stored[curr_bucket] == data->z_bucket_lengths[curr_bucket])
+    return;
 
-  _safe_malloc (bush_xs, sizeof (double) * bush_size);
-  _safe_malloc (bush_ys, sizeof (double) * bush_size);
-
-  int i = 0;
+  /*
+   * On a sample, the search may stop at another bucket
+   * than it would on the whole cloud. Walk down again
+   * with an interval on each bucket's count in the
+   * trunk circle, widened to the circle the upper bound
+   * on the trunk diameter gives. The search can stop at
+   * the first bucket whose interval leaves the expected
+   * range, and must stop at the first whose interval
+   * lies wholly outside it. The ground lies in the
+   * bucket below either, and the nearest point outside
+   * may have been missed, but it is in that bucket.
+   */
+  circ_t outer_circ = *trunk_err_circ;
+  if (trunk->circ.rad > 0)
+    outer_circ.rad *= trunk->diam_ci.hi / (2 * trunk->circ.rad);
 
-  /* Collect bush x/y coords. */
-  for (curr = data->z_num_buckets - 1; curr > max_trunkbucket; curr--)
+  int first_stop = -1;
+  int last_stop = -1;
+  for (int bucket = start_bucket; bucket >= 0; bucket--)
   {
-    for (int j = 0; j < data->z_bucket_lengths[curr]; j++)
+    conf_int_t count_ci, outer_ci;
+
+    if (data->z_bucket_lengths[bucket] <= trunk_count - count_margin)
+      count_ci.lo = count_ci.hi = data->z_bucket_lengths[bucket];
+    else
     {
-      bush_xs[i] = data->x_z_bucket[curr][j];
-      bush_ys[i] = data->y_z_bucket[curr][j];
-      i++;
+      _count_in_circ (data, bucket, trunk_err_circ, &count_ci);
+      _count_in_circ (data, bucket, &outer_circ, &outer_ci);
+      count_ci.hi = fmax (count_ci.hi, outer_ci.hi);
     }
-  }
-
-  int *conv_indices = get_convhull_indices (bush_xs, bush_ys, i);
-  int convind_sz;
-  for (convind_sz = 0; conv_indices[convind_sz] != -1; convind_sz++)
-    ;
 
-  /*
-   * Converge on furthest points away from one
-   * another in hull. This is doable by the nature
-   * of a convex hull in linear time.
-   */
-  int pt1 = conv_indices[0];
-  int pt2 = conv_indices[1];
+    bool may_stop = (count_ci.lo <= trunk_count - count_margin)
+                    || (count_ci.hi >= trunk_count + count_margin);
+    bool must_stop = (count_ci.hi <= trunk_count - count_margin)
+                     || (count_ci.lo >= trunk_count + count_margin);
 
-  while (1)
-  {
-    /* Test adjacent points. */
-    int adjpts1[3] = {
-      (pt1 == 0 ? convind_sz-1 : pt1-1),
-      pt1,
-      (pt1 == convind_sz-1 ? 0 : pt1+1)};
-    int adjpts2[3] = {
-      (pt2 == 0 ? convind_sz-1 : pt2-1),
-      pt2,
-      (pt2 == convind_sz-1 ? 0 : pt2+1)};
-
-    int pt1_max = pt1;
-    int pt2_max = pt2;
-    double sqdist_max = 0;
-
-    for (int i = 0; i < 3; i++)
-      for (int j = 0; j < 3; j++)
-      {
-        int p1 = adjpts1[i];
-        int p2 = adjpts2[j];
-        double sqdist = _square_dist (
-            bush_xs[p1], bush_xs[p2], bush_ys[p1], bush_ys[p2]
-            );
-        if (sqdist > sqdist_max)
-        {
-          sqdist_max = sqdist;
-          pt1_max = p1;
-          pt2_max = p2;
-        }
-      }
-    if (pt1_max == pt1 && pt2_max == pt2)
-      break;
-    else
+    if (may_stop && first_stop == -1)
+      first_stop = bucket;
+    if (must_stop)
     {
-      pt1 = pt1_max;
-      pt2 = pt2_max;
+      last_stop = bucket;
+      break;
     }
   }
 
-  data->maxbranchdiam = sqrt (_square_dist (
-      bush_xs[pt1], bush_xs[pt2], bush_ys[pt1], bush_ys[pt2]
-      ));
+  int lowest = (last_stop == -1) ? 0 : (last_stop + 1);
+  int highest = (first_stop == -1) ? 0 : (first_stop + 1);
+  if (lowest > curr_bucket)
+    lowest = curr_bucket;
+  if (highest < curr_bucket)
+    highest = curr_bucket;
+  if (highest > data->z_num_buckets - 1)
+    highest = data->z_num_buckets - 1;
+
+  height_ci->lo = data->max_z
+                  - (data->min_z + (highest + 1) * params->zbucket_range);
+  height_ci->hi = data->max_z
+                  - (data->min_z + lowest * params->zbucket_range);
+}
+
+/*
+ * process_tree_pointdata:
+ * Process the data to find the trunk, max branch
+ * and vertical lengths of the tree. This is all
+ * done in one function as they are all
+ * intertwined operations.
+ */
+void
+process_tree_pointdata (tree_pointdata_t *data)
+{
+  /* Find the highest trunk bucket. */
+  int max_trunkbucket = find_trunk_top (data, &data->params);
+
+  if (max_trunkbucket == -1)
+    _EXIT_FAIL ("Error in process_tree_pointdata from failing to find trunk top")
+
+  /* Find trunk diameter */
+
+  trunk_t trunk;
+
+  fit_trunk (data, max_trunkbucket, &data->params, &trunk);
+  data->trunkdiam = 2 * trunk.circ.rad;
+  data->trunkdiam_ci = trunk.diam_ci;
+
+  /* Find tree height */
+
+  find_height (data, max_trunkbucket, &data->params, &trunk,
+               &data->treeheight, &data->treeheight_ci);
+
+  /* Find max branch diameter */
+
+  data->crown_base_bucket = max_trunkbucket + 1;
+  data->crown_num_buckets = data->z_num_buckets - 1 - max_trunkbucket;
+  compute_crown_profile (data, max_trunkbucket,
+                         &data->crown_bucket_diams, &data->crown_cum_diams,
+                         &data->maxbranchdiam, &data->maxbranchdiam_ci);
 
   data->processed = 1;
 }
@@ -592,6 +1997,320 @@ tree_pointdata_get_maxbranchdiam (tree_pointdata_t *data)
   return data->maxbranchdiam;
 }
 
+/*
+ * tree_pointdata_get_*_ci:
+ * Get the approximate confidence interval, at level
+ * 1 - APPROX_CONF_ALPHA, on each metric. Metrics
+ * found without sampling have lo == hi.
+ */
+conf_int_t
+tree_pointdata_get_trunkdiam_ci (tree_pointdata_t *data)
+{
+  if (!data->processed)
+    process_tree_pointdata (data);
+
+  return data->trunkdiam_ci;
+}
+
+conf_int_t
+tree_pointdata_get_height_ci (tree_pointdata_t *data)
+{
+  if (!data->processed)
+    process_tree_pointdata (data);
+
+  return data->treeheight_ci;
+}
+
+conf_int_t
+tree_pointdata_get_maxbranchdiam_ci (tree_pointdata_t *data)
+{
+  if (!data->processed)
+    process_tree_pointdata (data);
+
+  return data->maxbranchdiam_ci;
+}
+
+/*
+ * tree_pointdata_get_kept_rate:
+ * Get the portion of the cloud actually kept. This
+ * is 1 if it was not sampled, and may be above the
+ * sample rate asked for, since each bucket keeps at
+ * least SAMPLE_MIN_PER_BUCKET points.
+ */
+double
+tree_pointdata_get_kept_rate (tree_pointdata_t *data)
+{
+  unsigned int kept = 0;
+
+  if (data->num_coords == 0)
+    return 1;
+
+  for (int i = 0; i < data->z_num_buckets; i++)
+    kept += data->z_bucket_stored[i];
+
+  return ((double) kept) / data->num_coords;
+}
+
+/*
+ * tree_pointdata_get_crown_profile:
+ * Get the crown diameter per bucket above the
+ * trunk, lowest bucket first. Each entry of
+ * bucket_diams is the diameter of that bucket
+ * alone, and each entry of cum_diams that of the
+ * bucket and all above it. If base_z is not NULL,
+ * it is set to the z-value the lowest bucket starts
+ * at; entry j starts zbucket_range * j above it.
+ * Returns the number of entries.
+ */
+unsigned int
+tree_pointdata_get_crown_profile (tree_pointdata_t *data,
+                                  const double **bucket_diams,
+                                  const double **cum_diams,
+                                  double *base_z)
+{
+  if (!data->processed)
+    process_tree_pointdata (data);
+
+  if (base_z != NULL)
+    *base_z = data->min_z
+              + (data->crown_base_bucket * data->params.zbucket_range);
+
+  if (bucket_diams != NULL)
+    *bucket_diams = data->crown_bucket_diams;
+  if (cum_diams != NULL)
+    *cum_diams = data->crown_cum_diams;
+
+  return data->crown_num_buckets;
+}
+
+/*
+ * _parallel_for_worker:
+ * Run tasks from a parallel_for_t until
+ * none are left.
+ */
+void *
+_parallel_for_worker (void *arg)
+{
+  parallel_for_t *pfor = (parallel_for_t *) arg;
+
+  while (1)
+  {
+    pthread_mutex_lock (&pfor->lock);
+    unsigned int task = pfor->next_task++;
+    pthread_mutex_unlock (&pfor->lock);
+
+    if (task >= pfor->num_tasks)
+      break;
+    pfor->task (pfor->ctx, task);
+  }
+
+  return NULL;
+}
+
+/*
+ * parallel_for:
+ * Run task (ctx, i) for every i below num_tasks,
+ * on up to num_threads threads.
+ */
+void
+parallel_for (unsigned int num_tasks, unsigned int num_threads,
+              void (*task) (void *, unsigned int), void *ctx)
+{
+  parallel_for_t pfor;
+  pthread_t *threads;
+
+  if (num_threads > num_tasks)
+    num_threads = num_tasks;
+
+  if (num_threads <= 1)
+  {
+    for (unsigned int i = 0; i < num_tasks; i++)
+      task (ctx, i);
+    return;
+  }
+
+  pfor.task = task;
+  pfor.ctx = ctx;
+  pfor.num_tasks = num_tasks;
+  pfor.next_task = 0;
+  pthread_mutex_init (&pfor.lock, NULL);
+
+  _safe_malloc (threads, sizeof (pthread_t) * num_threads);
+  for (int t = 0; t < num_threads; t++)
+    if (pthread_create (&threads[t], NULL, _parallel_for_worker, &pfor) != 0)
+      _EXIT_FAIL ("Error in parallel_for on creating thread")
+  for (int t = 0; t < num_threads; t++)
+    pthread_join (threads[t], NULL);
+
+  pthread_mutex_destroy (&pfor.lock);
+  free (threads);
+}
+
+/*
+ * _sweep_shared_task:
+ * Find one distinct crown or trunk fit in a sweep.
+ * Crowns come first, then fits.
+ */
+void
+_sweep_shared_task (void *arg, unsigned int task)
+{
+  sweep_ctx_t *ctx = (sweep_ctx_t *) arg;
+
+  if (task < ctx->num_tops)
+  {
+    compute_crown_profile (ctx->data, ctx->tops[task], NULL, NULL,
+                           &ctx->top_maxdiams[task],
+                           &ctx->top_maxdiam_cis[task]);
+    return;
+  }
+
+  unsigned int fit = task - ctx->num_tops;
+  sweep_result_t *res = &ctx->results[ctx->fit_sets[fit]];
+  fit_trunk (ctx->data, res->trunk_top, &res->params, &ctx->fits[fit]);
+}
+
+/*
+ * _sweep_set_task:
+ * Finish the metrics for one set in a sweep, from
+ * its shared crown and trunk fit.
+ */
+void
+_sweep_set_task (void *arg, unsigned int set)
+{
+  sweep_ctx_t *ctx = (sweep_ctx_t *) arg;
+  sweep_result_t *res = &ctx->results[set];
+
+  if (res->trunk_top == -1)
+    return;
+
+  trunk_t trunk = ctx->fits[ctx->set_fits[set]];
+  set_trunk_margin (&trunk, &res->params);
+  res->margin_used = !trunk.inlier_band;
+
+  res->trunkdiam = 2 * trunk.circ.rad;
+  res->trunkdiam_ci = trunk.diam_ci;
+  res->maxbranchdiam = ctx->top_maxdiams[ctx->set_tops[set]];
+  res->maxbranchdiam_ci = ctx->top_maxdiam_cis[ctx->set_tops[set]];
+
+  find_height (ctx->data, res->trunk_top, &res->params, &trunk,
+               &res->treeheight, &res->treeheight_ci);
+}
+
+/*
+ * _same_trunk_fit:
+ * Check whether two sets of parameters fit the
+ * same trunk circle at the same trunk top.
+ */
+bool
+_same_trunk_fit (const sweep_result_t *res1, const sweep_result_t *res2)
+{
+  const tree_params_t *p1 = &res1->params;
+  const tree_params_t *p2 = &res2->params;
+
+  if (res1->trunk_top != res2->trunk_top || p1->trunk_fit != p2->trunk_fit)
+    return false;
+  if (p1->trunk_fit != TRUNK_FIT_RANSAC)
+    return true;
+  return p1->ransac_buckets == p2->ransac_buckets
+         && p1->ransac_inlier_tol == p2->ransac_inlier_tol;
+}
+
+/*
+ * tree_pointdata_sweep:
+ * Find the metrics under each of several sets of
+ * parameters, on a cloud loaded once. Bucketing
+ * settings and the sample rate are those the data
+ * was loaded with, whatever the sets say; the number
+ * of threads is taken from data->params. Sets with a
+ * setting out of range are not run, and their results
+ * are marked invalid. Returns an array of results, in
+ * the order of the sets, for the caller to free.
+ */
+sweep_result_t *
+tree_pointdata_sweep (tree_pointdata_t *data, const tree_params_t *sets,
+                      unsigned int num_sets)
+{
+  /*
+   * The buckets are only read, so sets can share them
+   * across threads. We first find every set's trunk top,
+   * which is cheap with the pyramid. Sets sharing a top
+   * share the crown above it, which is the costliest
+   * step, and sets sharing a top and fitting method
+   * share the trunk fit. Each of these is found once, in
+   * parallel, and then each set's ground search is run
+   * in parallel with the margin it asks for.
+   */
+  sweep_ctx_t ctx;
+  sweep_result_t *results;
+
+  _safe_malloc (results, sizeof (sweep_result_t) * (num_sets + 1));
+  _safe_malloc (ctx.tops, sizeof (int) * (num_sets + 1));
+  _safe_malloc (ctx.fit_sets, sizeof (unsigned int) * (num_sets + 1));
+  _safe_malloc (ctx.set_tops, sizeof (unsigned int) * (num_sets + 1));
+  _safe_malloc (ctx.set_fits, sizeof (unsigned int) * (num_sets + 1));
+
+  ctx.data = data;
+  ctx.results = results;
+  ctx.num_tops = 0;
+  ctx.num_fits = 0;
+
+  for (int i = 0; i < num_sets; i++)
+  {
+    sweep_result_t *res = &results[i];
+
+    res->params = sets[i];
+    res->params.zbucket_range = data->params.zbucket_range;
+    res->params.zbucket_size = data->params.zbucket_size;
+    res->params.sample_rate = data->params.sample_rate;
+
+    res->valid = tree_params_valid (&res->params);
+    res->margin_used = false;
+    res->trunk_top = res->valid ? find_trunk_top (data, &res->params) : -1;
+    res->trunkdiam = NAN;
+    res->maxbranchdiam = NAN;
+    res->treeheight = NAN;
+    res->trunkdiam_ci.lo = res->trunkdiam_ci.hi = NAN;
+    res->maxbranchdiam_ci.lo = res->maxbranchdiam_ci.hi = NAN;
+    res->treeheight_ci.lo = res->treeheight_ci.hi = NAN;
+
+    if (res->trunk_top == -1)
+      continue;
+
+    int top;
+    for (top = 0; top < ctx.num_tops && ctx.tops[top] != res->trunk_top; top++)
+      ;
+    if (top == ctx.num_tops)
+      ctx.tops[ctx.num_tops++] = res->trunk_top;
+    ctx.set_tops[i] = top;
+
+    int fit;
+    for (fit = 0; fit < ctx.num_fits
+                  && !_same_trunk_fit (&results[ctx.fit_sets[fit]], res); fit++)
+      ;
+    if (fit == ctx.num_fits)
+      ctx.fit_sets[ctx.num_fits++] = i;
+    ctx.set_fits[i] = fit;
+  }
+
+  _safe_malloc (ctx.top_maxdiams, sizeof (double) * (ctx.num_tops + 1));
+  _safe_malloc (ctx.top_maxdiam_cis, sizeof (conf_int_t) * (ctx.num_tops + 1));
+  _safe_malloc (ctx.fits, sizeof (trunk_t) * (ctx.num_fits + 1));
+
+  parallel_for (ctx.num_tops + ctx.num_fits, data->params.num_threads,
+                _sweep_shared_task, &ctx);
+  parallel_for (num_sets, data->params.num_threads, _sweep_set_task, &ctx);
+
+  free (ctx.tops);
+  free (ctx.fit_sets);
+  free (ctx.set_tops);
+  free (ctx.set_fits);
+  free (ctx.top_maxdiams);
+  free (ctx.top_maxdiam_cis);
+  free (ctx.fits);
+
+  return results;
+}
+
 void
 tree_pointdata_free (tree_pointdata_t *data)
 {
@@ -608,5 +2327,15 @@ tree_pointdata_free (tree_pointdata_t *data)
   free (data->y_z_bucket);
   free (data->z_z_bucket);
   free (data->z_bucket_lengths);
+  free (data->z_bucket_stored);
+  for (int k = 0; k < data->pyramid.num_levels; k++)
+  {
+    free (data->pyramid.mins[k]);
+    free (data->pyramid.maxs[k]);
+  }
+  free (data->pyramid.mins);
+  free (data->pyramid.maxs);
+  free (data->crown_bucket_diams);
+  free (data->crown_cum_diams);
   free (data);
 }
@@ -3,11 +3,51 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
 
-/* Portion change in size expected between trunk buckets. */
+/*
+ * Defaults for tree_params_t.
+ * Portion change in size expected between trunk buckets.
+ */
 #define TRUNK_BUCKET_DIFF_THRESH 0.2
 /* Portion change in size expected trunk and widest buckets on tree. */
 #define TRUNK_BUCKET_MAXDIFF_THRESH 9
+/* Portion of trunk radius the ground search allows around the trunk. */
+#define TRUNK_CIRC_MARGIN 0.2
+
+/* Confidence level of intervals on sampled metrics is 1 - this. */
+#define APPROX_CONF_ALPHA 0.05
+/* Two-sided normal quantile matching APPROX_CONF_ALPHA. */
+#define APPROX_CONF_Z 1.96
+/*
+ * Fewest points kept per bucket when sampling. Rates
+ * below about this many points per bucket all keep
+ * the same sample; see tree_pointdata_get_kept_rate.
+ */
+#define SAMPLE_MIN_PER_BUCKET 32
+/* Z-values kept on the first pass to estimate bucket fullness. */
+#define SAMPLE_Z_ESTIMATE 4096
+/* Seed for sampling and fitting, so runs are repeatable. */
+#define RAND_SEED 0x9e3779b97f4a7c15ULL
+
+/* Default trunk fitting method; see trunk_fit_t. */
+#define TRUNK_FIT_DEFAULT TRUNK_FIT_MEC
+/* Buckets from the trunk top down that RANSAC fits, one per thread. */
+#define RANSAC_NUM_BUCKETS 4
+/*
+ * Greatest distance from a RANSAC circle for a point to
+ * be an inlier, as a portion of the radius of the
+ * bucket's minimum enclosing circle.
+ */
+#define RANSAC_INLIER_TOL 0.05
+/* RANSAC stops at this many tries, or once this sure of its fit. */
+#define RANSAC_MAX_ITERS 1000
+#define RANSAC_CONFIDENCE 0.99
+/* Relative size of a turn below which hull points count as collinear. */
+#define HULL_COLLINEAR_TOL 1e-12
+/* Default most threads to run at once. */
+#define NUM_THREADS 4
 
 /* Define this as a standard way to fail. */
 #define _EXIT_FAIL(msg_prefix) { \
@@ -28,6 +68,56 @@
 
 #define _square_dist(x1, x2, y1, y2) (((x1-x2)*(x1-x2)) + ((y1-y2)*(y1-y2)))
 
+/*
+ * conf_int_t: Lower and upper bounds on a
+ * metric found from a sampled cloud.
+ */
+typedef struct conf_int {
+  double lo;
+  double hi;
+} conf_int_t;
+
+/*
+ * trunk_fit_t: Methods of fitting a circle
+ * to the trunk.
+ */
+typedef enum trunk_fit {
+  TRUNK_FIT_CENTROID, /* About the centroid, to the farthest point */
+  TRUNK_FIT_MEC, /* Minimum enclosing circle, by Welzl's algorithm */
+  TRUNK_FIT_RANSAC /* RANSAC over several buckets, in parallel */
+} trunk_fit_t;
+
+/*
+ * tree_params_t: Settings for bucketing and
+ * processing a point cloud, given at runtime.
+ * Start from tree_params_default ().
+ */
+typedef struct tree_params {
+  double zbucket_range; /* Range of Z-values per bucket */
+  unsigned int zbucket_size; /* Initial size of each bucket */
+  double trunk_diff_thresh; /* See TRUNK_BUCKET_DIFF_THRESH */
+  double trunk_maxdiff_thresh; /* See TRUNK_BUCKET_MAXDIFF_THRESH */
+  double trunk_circ_margin; /* See TRUNK_CIRC_MARGIN */
+  double sample_rate; /* Portion of cloud to keep; 1 keeps all */
+  trunk_fit_t trunk_fit; /* How to fit the trunk */
+  unsigned int ransac_buckets; /* See RANSAC_NUM_BUCKETS */
+  double ransac_inlier_tol; /* See RANSAC_INLIER_TOL */
+  unsigned int num_threads; /* Most threads to run at once */
+} tree_params_t;
+
+/*
+ * zbucket_pyramid_t: Bucket counts at successively
+ * coarser resolutions. Level 0 has one node per
+ * z-bucket, and each node at level k merges two
+ * at level k - 1, holding the least and greatest
+ * of the bucket counts under it.
+ */
+typedef struct zbucket_pyramid {
+  unsigned int num_levels;
+  unsigned int **mins;
+  unsigned int **maxs;
+} zbucket_pyramid_t;
+
 /*
  * tree_pointdata_t: Container datatype for all
  * information on point cloud for a tree.
@@ -37,7 +127,7 @@ typedef struct tree_pointdata {
   unsigned int num_coords;
   /*
    * Dynamic arrays of x-coordinates, y-coordinates and
-   * z-coordinates respectively.
+   * z-coordinates respectively. NULL if sampled.
    */
   double *xs;
   double *ys;
@@ -59,9 +149,19 @@ typedef struct tree_pointdata {
   double **z_z_bucket;
   unsigned int *z_bucket_lengths;
   unsigned int z_num_buckets;
-  /* Range of Z-values per bucket. */
+  /*
+   * Number of points actually held per bucket. Equal
+   * to z_bucket_lengths unless the cloud was sampled,
+   * in which case z_bucket_lengths still holds the
+   * exact counts.
+   */
+  unsigned int *z_bucket_stored;
+  /* Pyramid of z_bucket_lengths, for coarse-to-fine searches. */
+  zbucket_pyramid_t pyramid;
+  /* Defaults for range of Z-values per bucket, and bucket size. */
 #define ZBUCKET_RANGE 0.1
 #define ZBUCKET_SIZE 200
+  tree_params_t params;
 
   char processed; /* == 1 if processed, 0 if not */
 
@@ -69,6 +169,20 @@ typedef struct tree_pointdata {
   double trunkdiam; /* Trunk diameter */
   double maxbranchdiam; /* Max branch diameter */
   double treeheight; /* Tree height */
+  conf_int_t trunkdiam_ci;
+  conf_int_t maxbranchdiam_ci;
+  conf_int_t treeheight_ci;
+
+  /*
+   * Crown width profile, one entry per bucket from
+   * crown_base_bucket (just above the trunk) upwards.
+   * crown_bucket_diams holds each bucket's own diameter,
+   * crown_cum_diams that of it and every bucket above.
+   */
+  double *crown_bucket_diams;
+  double *crown_cum_diams;
+  unsigned int crown_num_buckets;
+  unsigned int crown_base_bucket;
 } tree_pointdata_t;
 
 /*
@@ -81,6 +195,89 @@ typedef struct circ {
     double rad;
 } circ_t;
 
+/*
+ * trunk_t: Circle fitted to the trunk at its
+ * highest bucket, and the circle and point count
+ * the ground search expects in trunk buckets below.
+ */
+typedef struct trunk {
+  circ_t circ;
+  conf_int_t diam_ci;
+  circ_t err_circ;
+  double ref_count;
+  bool inlier_band; /* err_circ set from RANSAC inliers, not the margin */
+} trunk_t;
+
+/*
+ * ransac_job_t: A RANSAC circle fit of one
+ * bucket, run on its own thread.
+ */
+typedef struct ransac_job {
+  tree_pointdata_t *data;
+  const tree_params_t *params;
+  int bucket;
+  /* Below are filled in by the fit. */
+  bool ok; /* false if no circle could be fitted */
+  circ_t circ;
+  unsigned int inliers;
+  double band; /* Distance of the farthest inlier from the circle */
+  double rad_var; /* Variance of inlier distances from centre */
+} ransac_job_t;
+
+/*
+ * sweep_result_t: Metrics found with one set of
+ * parameters in a sweep. trunk_top is -1, and the
+ * metrics NAN, if the set was invalid or no trunk
+ * was found.
+ */
+typedef struct sweep_result {
+  tree_params_t params;
+  bool valid; /* false if a setting was out of range */
+  bool margin_used; /* false if a RANSAC inlier band replaced the margin */
+  int trunk_top;
+  double trunkdiam;
+  double maxbranchdiam;
+  double treeheight;
+  conf_int_t trunkdiam_ci;
+  conf_int_t maxbranchdiam_ci;
+  conf_int_t treeheight_ci;
+} sweep_result_t;
+
+/*
+ * sweep_ctx_t: State shared by the threads of a
+ * sweep. Crowns depend only on the trunk top, and
+ * trunk fits on the top and fitting settings, so
+ * each distinct one is found once and shared.
+ */
+typedef struct sweep_ctx {
+  tree_pointdata_t *data;
+  sweep_result_t *results;
+  /* Distinct trunk tops, and the crown above each. */
+  int *tops;
+  unsigned int num_tops;
+  double *top_maxdiams;
+  conf_int_t *top_maxdiam_cis;
+  /* Distinct trunk fits, and the first set needing each. */
+  trunk_t *fits;
+  unsigned int *fit_sets;
+  unsigned int num_fits;
+  /* Index into tops and fits for each set. */
+  unsigned int *set_tops;
+  unsigned int *set_fits;
+} sweep_ctx_t;
+
+/*
+ * parallel_for_t: A range of tasks handed out
+ * to threads one at a time.
+ */
+typedef struct parallel_for {
+  void (*task) (void *, unsigned int);
+  void *ctx;
+  unsigned int num_tasks;
+  unsigned int next_task;
+  pthread_mutex_t lock;
+} parallel_for_t;
+
 /*
  * cmp_val_t: Comparable value for sorting
  * list of x-y coordinates. (Don't need Z
@@ -94,11 +291,33 @@ typedef struct cmp_val {
 
 
 tree_pointdata_t *tree_pointdata_init (const char *);
+tree_pointdata_t *tree_pointdata_init_sampled (const char *, double);
+tree_pointdata_t *tree_pointdata_init_params (const char *,
+                                              const tree_params_t *);
+void tree_params_default (tree_params_t *);
+bool tree_params_valid (const tree_params_t *);
 
 double tree_pointdata_get_trunkdiam (tree_pointdata_t *);
 double tree_pointdata_get_height (tree_pointdata_t *);
 double tree_pointdata_get_maxbranchdiam (tree_pointdata_t *);
+conf_int_t tree_pointdata_get_trunkdiam_ci (tree_pointdata_t *);
+conf_int_t tree_pointdata_get_height_ci (tree_pointdata_t *);
+conf_int_t tree_pointdata_get_maxbranchdiam_ci (tree_pointdata_t *);
+double tree_pointdata_get_kept_rate (tree_pointdata_t *);
+unsigned int tree_pointdata_get_crown_profile (tree_pointdata_t *,
+                                              const double **,
+                                              const double **, double *);
+
+sweep_result_t *tree_pointdata_sweep (tree_pointdata_t *,
+                                      const tree_params_t *, unsigned int);
 
 void tree_pointdata_free (tree_pointdata_t *);
 
+/* Geometry helpers, exposed for checking. */
+int *get_convhull_indices (double *, double *, int);
+double get_convhull_diam (double *, double *, int *, int *, int *);
+void fit_trunk_mec (tree_pointdata_t *, int, trunk_t *);
+bool fit_trunk_ransac (tree_pointdata_t *, int, const tree_params_t *,
+                       trunk_t *);
+
 #endif /* TREEPOINT_DATA_H */